@@ -0,0 +1,197 @@
+#include "alloc.hpp"
+#include <atomic>
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include <cstdlib>
+
+using namespace std;
+
+namespace alloc {
+
+const char *name(uint s) {
+    static const char *names[] = {
+        "other", "physics", "render", "net", "level", "total"
+    };
+
+    return (s <= subsystems)? names[s] : "?";
+}
+
+void reportFrame(ostream &out, const Frame &f, uint frames) {
+    out << "alloc/frame:";
+    for(uint s = 0; s <= subsystems; s++)
+        out << " " << name(s) << " " << (double) f.allocs[s] / max(frames, 1u);
+    out << "; live " << f.live / 1024 << "KiB, peak " << f.peak / 1024
+        << "KiB" << endl;
+}
+
+}
+
+#ifdef ALLOC_TRACK
+
+namespace {
+
+struct Tally {
+    atomic<unsigned long long> allocs, frees, bytes;
+    atomic<long long> live, peak;
+};
+
+// Zeroed before any constructor runs, new may come before main().
+Tally tallies[alloc::subsystems + 1];
+thread_local uint current = alloc::other;
+
+// In front of every block: its size and subsystem, 16 to keep alignment.
+struct Header {
+    size_t size;
+    uint subsystem;
+};
+const size_t headerSize = 16;
+static_assert(sizeof(Header) <= headerSize, "header doesn't fit");
+
+void grow(Tally &t, size_t size) {
+    t.allocs.fetch_add(1, memory_order_relaxed);
+    t.bytes.fetch_add(size, memory_order_relaxed);
+    long long live = t.live.fetch_add(size, memory_order_relaxed) + size,
+              peak = t.peak.load(memory_order_relaxed);
+    while(live > peak
+          && !t.peak.compare_exchange_weak(peak, live, memory_order_relaxed));
+}
+
+void *take(size_t size) {
+    Header *h = (Header *) malloc(headerSize + size);
+    if(!h)
+        return NULL;
+
+    h->size = size;
+    h->subsystem = current;
+    grow(tallies[current], size);
+    grow(tallies[alloc::subsystems], size);
+
+    return (char *) h + headerSize;
+}
+
+void give(void *p) {
+    if(!p)
+        return;
+
+    Header *h = (Header *) ((char *) p - headerSize);
+    for(Tally *t : {&tallies[h->subsystem], &tallies[alloc::subsystems]}) {
+        t->frees.fetch_add(1, memory_order_relaxed);
+        t->live.fetch_sub(h->size, memory_order_relaxed);
+    }
+    free(h);
+}
+
+void *takeOrThrow(size_t size) {
+    void *p = take(size);
+    if(!p)
+        throw bad_alloc();
+
+    return p;
+}
+
+/* Whole report once the program ends, however it ends. Made first
+ * thing, so it's destroyed last. */
+struct ReportOnExit {
+    ~ReportOnExit() { alloc::report(cerr); }
+} reportOnExit __attribute__((init_priority(101)));
+
+}
+
+void *operator new(size_t size) { return takeOrThrow(size); }
+void *operator new[](size_t size) { return takeOrThrow(size); }
+void *operator new(size_t size, const nothrow_t &) noexcept {
+    return take(size);
+}
+void *operator new[](size_t size, const nothrow_t &) noexcept {
+    return take(size);
+}
+void operator delete(void *p) noexcept { give(p); }
+void operator delete[](void *p) noexcept { give(p); }
+void operator delete(void *p, const nothrow_t &) noexcept { give(p); }
+void operator delete[](void *p, const nothrow_t &) noexcept { give(p); }
+void operator delete(void *p, size_t) noexcept { give(p); }
+void operator delete[](void *p, size_t) noexcept { give(p); }
+
+AllocScope::AllocScope(alloc::Subsystem s): previous(current) {
+    current = s;
+}
+
+AllocScope::~AllocScope() {
+    current = previous;
+}
+
+namespace alloc {
+
+bool enabled() { return true; }
+
+Stats stats() {
+    Stats st;
+    for(uint s = 0; s <= subsystems; s++) {
+        Counters &c = st.of[s];
+        c.allocs = tallies[s].allocs;
+        c.frees = tallies[s].frees;
+        c.bytes = tallies[s].bytes;
+        c.live = tallies[s].live;
+        c.peak = tallies[s].peak;
+    }
+
+    return st;
+}
+
+Frame frame() {
+    static unsigned long long before[subsystems + 1];
+
+    Frame f;
+    for(uint s = 0; s <= subsystems; s++) {
+        unsigned long long n = tallies[s].allocs;
+        f.allocs[s] = n - before[s];
+        before[s] = n;
+    }
+    f.live = tallies[subsystems].live;
+    f.peak = tallies[subsystems].peak;
+
+    return f;
+}
+
+void report(ostream &out) {
+    Stats st = stats();
+    out << "heap by subsystem       allocs        frees    MiB total"
+           "    KiB live    KiB peak" << endl;
+    for(uint s = 0; s <= subsystems; s++) {
+        Counters &c = st.of[s];
+        out << "  " << left << setw(12) << name(s) << right
+            << setw(13) << c.allocs << setw(13) << c.frees
+            << setw(13) << fixed << setprecision(1) << c.bytes / 1048576.0
+            << setw(12) << c.live / 1024 << setw(12) << c.peak / 1024
+            << endl;
+    }
+    out.unsetf(ios::fixed);
+}
+
+}
+
+#else
+
+AllocScope::AllocScope(alloc::Subsystem s): previous(alloc::other) {}
+
+AllocScope::~AllocScope() {}
+
+namespace alloc {
+
+bool enabled() { return false; }
+
+Stats stats() { return Stats(); }
+
+Frame frame() {
+    Frame f = Frame();
+    return f;
+}
+
+void report(ostream &out) {
+    out << "heap is not tracked, build with ALLOC_TRACK" << endl;
+}
+
+}
+
+#endif
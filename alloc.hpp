@@ -0,0 +1,71 @@
+#pragma once
+#include <ostream>
+
+using namespace std;
+
+/* Heap accounting per subsystem, for finding what allocates every
+ * frame and what keeps growing.
+ *
+ * It's opt-in: built with -DALLOC_TRACK (make ALLOC=track), global
+ * operator new and delete count every allocation against subsystem
+ * the thread is in just then, as the innermost AllocScope says, and
+ * everything is reported on exit. Built without it, scopes do nothing
+ * and nothing is counted. Only alloc.cpp looks at ALLOC_TRACK, the
+ * header is the same either way, so other objects don't care how
+ * alloc.o was built.
+ *
+ * Every block carries its size and subsystem in front of it, so live
+ * bytes go down where they went up, whoever frees the block. Only what
+ * goes through operator new is seen, SDL's own mallocs are not. */
+namespace alloc {
+
+enum Subsystem {
+    other, physics, render, net, level, subsystems
+};
+
+const char *name(uint s);
+
+// True if built with ALLOC_TRACK.
+bool enabled();
+
+struct Counters {
+    unsigned long long allocs = 0, frees = 0,
+                       bytes = 0;     // all ever allocated
+    long long live = 0, peak = 0;     // bytes
+};
+
+// Index subsystems is the sum of all of them.
+struct Stats {
+    Counters of[subsystems + 1];
+};
+
+Stats stats();
+
+/* Allocations of each subsystem since the previous frame(), or since
+ * the start; index subsystems is the sum. Call it once a frame, from
+ * one thread. */
+struct Frame {
+    unsigned long long allocs[subsystems + 1];
+    long long live, peak;
+};
+
+Frame frame();
+
+// Table of stats(), one line per subsystem.
+void report(ostream &out);
+
+// One line about a frame, for showing while the game goes.
+void reportFrame(ostream &out, const Frame &f, uint frames = 1);
+
+}
+
+/* Allocations of this thread go to the subsystem while the scope
+ * lasts, then to whatever they went to before. */
+class AllocScope {
+    public:
+    AllocScope(alloc::Subsystem s);
+    ~AllocScope();
+
+    private:
+    uint previous;
+};
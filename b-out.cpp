@@ -1,932 +1,910 @@
 #include <SDL.h>
 #include <vector>
-#include <list>
-#include <map>
 #include <cstdlib>
 #include <random>
 #include <iostream>
+#include <chrono>
+#include <thread>
+#include <atomic>
 
-#include "net.hpp"
+#include "game.hpp"
 
 using namespace std;
 
-class bad_optional : public exception {};
-
-// optional is part of C++17, but not in my compiler :)
-template<class T>
-class optional {
+/* What a spectator sees: draws the latest state() that came from
+ * the server, on the stock level. Simulates nothing. */
+class SpectatorView : public Toy {
     public:
-    optional(): present(false) {}
-    optional(T value): val(value), present(true){}
+    SpectatorView(SpectatorClient *conn) : conn(conn) {}
+    ~SpectatorView() { delete conn; }
 
-    operator bool() {return present;}
-    T operator* () {
-        if(!present)
-            throw bad_optional();
-        return val;
-    }
+    void timePassed(Playground &pg, uint dt) {
+        conn->poll(state);
+    }
+
+    void draw(Canvas &canvas) {
+        try {
+            uint at = 0;
+            for(uint part = 0; part < 2; part++) {
+                uint n = read16(field(at, 2));
+                for(uint i = 0; i < n; i++) {
+                    Point p(string(field(at, 4), 4));
+                    if(part == 0) {
+                        canvas.color(0xff, 0xff, 0);
+                        canvas.fillCircle(p.x, p.y, 10);
+                    } else {
+                        canvas.color(150, 150, 150);
+                        canvas.fillRect(p.x, p.y, 100, 10);
+                    }
+                }
+            }
 
-    T* operator-> () {
-        if(!present)
-            throw bad_optional();
-        return &val;
+            uint boxes = read16(field(at, 2));
+            const char *bits = field(at, (boxes + 7) / 8);
+            for(uint i = 0; i < boxes; i++)
+                if(bits[i / 8] & (1 << (i % 8))) {
+                    Point p = stockBox(i);
+                    canvas.color(60 + 25 * (i % 8), 60 + 20 * (i / 8), 200);
+                    canvas.fillRect(p.x, p.y, 50, 20);
+                }
+        } catch (WrongFormat e) {}
     }
 
     private:
-
-    T val;
-    bool present;
-};
-
-void fatal() {
-    fprintf (stderr, "b-out: %s\n", SDL_GetError());
-    SDL_Quit();
-    exit(EXIT_FAILURE);
-}
-
-int random (uint min, uint max) {
-    std::random_device dev;
-    std::mt19937 rng(dev());
-    std::uniform_int_distribution<std::mt19937::result_type> dist(min,max);
-
-    return dist(rng);
-}
-
-void write16(void *buff, uint n) {
-    if(n & 0xffff0000)
-        cerr << "write16: value exeeds 16bits" << endl;
-
-    ((char *) buff)[0] = (char)(n & 0xff);
-    ((char *) buff)[1] = (char)((n >> 8) & 0xff);
-}
-
-uint read16(const void *buff) {
-    return (((uint)((char*) buff)[0]) & 0xff)
-        + ((((uint)((char*) buff)[1]) << 8) & 0xff00);
-}
-
-struct WrongFormat {};
-
-
-/* Point, Line, Segment, Mov. Classes to be considered in
- * sense of analytical geometry. */
-
-struct Point {
-    Point(): x(0), y(0) {}
-    Point(uint x, uint y): x(x), y(y) {}
-    Point(string bin) {
-        if(bin.size() != 4)
+    // Next n bytes of the state, throws if it's too short.
+    const char *field(uint &at, uint n) {
+        if(at + n > state.size())
             throw WrongFormat();
-
-        x = read16(bin.data());
-        y = read16(bin.data()+2);
-    };
-
-    uint dist(Point b) {
-        int dx = b.x - x,
-            dy = b.y - y;
-
-        return floor(sqrt(dx*dx + dy*dy));
-    }
-
-    string bin() {
-        char dst[4];
-        write16(dst, x);
-        write16(dst+2, y);
-
-        return string(dst, 4);
+        at += n;
+        return state.data() + at - n;
     }
-        
-    uint x, y;
-};
-
-struct Mov {
-    Mov(int dx, int dy): dx(dx), dy(dy) {}
 
-    Point apply(Point p) {
-        return Point(p.x + dx, p.y + dy);
-    }
-
-    int dx, dy;
+    SpectatorClient *conn;
+    string state;
 };
 
-struct Segment;
-
-class Line {
-    public:
-    Line(Point a, Point b) {
-        angle = (double)((int)b.y - (int)a.y) / ((int)b.x - (int)a.x);
-
-        if(isinf(angle))
-            x = a.x; 
-        else
-            y0 = a.y - angle*a.x;
-    }
-
-    optional<Point> intersection(Line b) {
-        if(angle == b.angle)
-            return optional<Point>();
-
-        if(isinf(angle)) 
-            return optional<Point>(Point(x, x*b.angle + b.y0));
-
-        if(isinf(b.angle))
-            return optional<Point>(Point(b.x, b.x*angle + y0));
-            
-
-        // y = a0 * x + b0
-        // y = a1 * x + b1
-        // thus
-        // a0 * x + b0 = a1 * x + b1
-        // a0 * x - a1 * x = b1 - b0
-        // (a0 - a1)*x = b1 - b0
-        // x = (b1 - b0) / (a0 - a1)
-        // having x, y is easy
-
-        double x = (b.y0 - y0) / (angle - b.angle);
-        return optional<Point>(Point(x, angle * x + y0));
-    }
-
-    Line perpendicular(Point p) {
-        double a = -(1/angle);
-        if(isinf(a))
-            return Line(a, p.x);
-        else
-            return Line(a, p.y - a * p.x);
-    }
-
-    uint dist(Point p) {
-        Point p2 = *(intersection(perpendicular(p)));
-        return p.dist(p2);
-    }
-
-    private:
-    Line(double a, double b) {
-        angle = a;
-        if(isinf(angle))
-            x = b;
-        else
-            y0 = b;
-    }
-
-    double angle, y0, x;
-};
-
-struct Segment {
-    Segment(Point a, Point b): a(a), b(b) {}
-
-    optional<Point> intersection(Segment s) {
-        optional<Point> candidate = Line(a, b).intersection(Line(s.a, s.b));
-        if(candidate && candidate->x >= min(a.x, b.x)
-                    && candidate->x <= max(a.x,b.x)
-                    && candidate->x >= min(s.a.x, s.b.x)
-                    && candidate->x <= max(s.a.x, s.b.x)
-                    && candidate->y >= min(a.y, b.y)
-                    && candidate->y <= max(a.y, b.y)
-                    && candidate->y >= min(s.a.y, s.b.y)
-                    && candidate->y <= max(s.a.y, s.b.y))
+enum Mode {
+    server, client, localmulti, bot, single
+} mode = single;
 
-            return candidate;
-        else
-            return optional<Point>();
+/* This function decides if there should be second player and
+ * constructs its object depending on game mode. */
+optional<Player*> playerForMode(Mode m, char *arg) {
+    switch(m) {
+        case server:
+            cout << "Waiting for second player…" << endl;
+            return optional<Player*>(
+                    new GuestRemote(
+                            new NetServer(),
+                            Point(350, 50),
+                            Ball::down
+                    )
+            );
+        case localmulti:
+            return optional<Player*>(
+                    (new LocalPlayer(Point(350, 50), Ball::down))
+                        ->withKeys(SDLK_a, SDLK_d)
+            );
+        case bot:
+            return optional<Player*>(
+                    new BotPlayer(Point(350, 50), Ball::down,
+                                  0.8, random(0, 0xffff))
+            );
+        case client:
+            return optional<Player*>(
+                    new HostRemote(
+                            new NetClient(string(arg)),
+                            Point(350, 550),
+                            Ball::up
+                    )
+            );
+        default:
+            return optional<Player*>();
     }
+}
 
-    optional<Point> closePoint(Segment s, uint distance) {
-        Line base(a,b);
-        Point p1 = *(base.intersection(base.perpendicular(s.b)));
-
-        double d;
-        if(a.x == b.x && p1.y >= min(a.y, b.y)
-                      && p1.y <= max(a.y, b.y))
-            d = p1.dist(s.b);
-        else if(a.y == b.y && p1.x >= min(a.x, b.x)
-                      && p1.x <= max(a.x, b.x))
-            d = p1.dist(s.b);
-        else
-            d = min(a.dist(s.b), b.dist(s.b));
-
-        if(d <= distance)
-            return Point((s.a.x+s.b.x)/2,
-                        (s.a.y+s.b.y)/2);
-
-        return optional<Point>();
-    } 
+void printRecorderStats(FrameRecorder &rec) {
+    RecorderStats st = rec.stats();
+    cerr << "recorded " << st.captured << " frames, dropped " << st.dropped
+         << ", " << st.fileBytes / 1024 << "KiB on disk, writer at "
+         << st.throughput() << "MB/s" << endl;
+    if(st.failed)
+        cerr << "writing the recording failed, it's cut short" << endl;
+}
 
-    Segment moved(Mov m) {
-        return Segment(m.apply(a), m.apply(b));
+// Turns a recording into a series of PPM pictures.
+void unpack(string path, string prefix) {
+    RecordingReader rec(path);
+    char name[16];
+    for(uint i = 0; rec.next(); i++) {
+        snprintf(name, sizeof(name), "%05u.ppm", i);
+        writePPM(prefix + name, rec.pixels(), rec.width(), rec.height());
     }
+}
 
-    Point a, b;
-};
-
-/* Game mechanics.
- * Playground is a central class, it defines comminication
- * with graphics API, it coordinates all elements of the
- * game. Playground.play() function contains program's
- * main event loop. */
-
-class Playground;
-
-
-/* Toy is an interface for all things displayed on the screen.
- *  draw() function called by playground to draw object on the
- *         screen.
- *
- *  timePassed() function called by playground to notify object
- *               that it should update its state. For example,
- *               apply its movement. dt means how much time
- *               passed, usually 1 unit.
- *
- *  collision() function called by playground to notify that
- *              there was collision with it. Currently collision()
- *              may happen only with a ball and ball is not notified,
- *              because it asks playground if it can move to given
- *              point, so that it knows.
- *
- *  destroyed() function called by playground to ask if object should
- *              be removed. Usually a box after certain number of
- *              collisions.
- *
- *  boundaries() function called by playground to get segments that
- *               represent object boundaries to be used in collision
- *               detection.
- */
-class Toy {
-    public:
-    virtual void draw(SDL_Renderer *renderer) = 0;
-    virtual void timePassed(Playground &pg, uint dt) = 0;
-    virtual ~Toy() {}
-    virtual void collision() {}
-    virtual bool destroyed() {return false;}
-
-    vector<Segment> &boundaries() {
-        return bounds;
+/* Bot tournament. Every worker thread plays its own matches on its
+ * own headless playground, they share only the counter of games
+ * left and sum up their stats at the very end. The two bots change
+ * sides every game, the stock level isn't the same seen from the top
+ * and from the bottom, so wins are counted for each bot and apart
+ * from that for each side. */
+struct TournamentStats {
+    uint games = 0, firstWins = 0, secondWins = 0, topWins = 0, draws = 0;
+    unsigned long long ticks = 0;
+
+    void add(TournamentStats &o) {
+        games += o.games;
+        firstWins += o.firstWins;
+        secondWins += o.secondWins;
+        topWins += o.topWins;
+        draws += o.draws;
+        ticks += o.ticks;
     }
-
-    protected:
-    vector<Segment> bounds;
 };
 
-struct Collision {
-    public:
-    Collision(){}
+// About 5 minutes of play at 60fps, then it's a draw.
+const uint matchTickLimit = 18000;
 
-    Collision(Point where, Mov continuation)
-        : really(true), where(where), continuation(continuation) {}
+/* Stock level with two bots. Everything random in it comes from
+ * the seed, so the same seed plays the same game. */
+struct BotMatch {
+    BotMatch(Backend backend, uint seed, double skillTop, double skillBottom)
+            : boxes((randomEngine().seed(seed), 64)),
+              pg(800, 600, backend) {
+        pg.kinetic();
+        for(uint i = 0; i < boxes.size(); i++)
+            pg.with(boxes[i].at(stockBox(i)));
 
-    bool really = false;
-    Point where = Point(0,0);
-    Mov continuation = Mov(0,0);
-};
-
-class KeyListener {
-    public:
-    virtual void keyPress(int action) = 0;
-};
-
-struct KeyBinding {
-    KeyBinding(){}
-    KeyBinding(KeyListener *listener, int actionId)
-        : listener(listener), action(actionId) {}
-
-    void trigger() {
-        listener->keyPress(action);
+        top = new BotPlayer(Point(350,50), Ball::down, skillTop, 2*seed);
+        bottom = new BotPlayer(Point(350,550), Ball::up,
+                               skillBottom, 2*seed + 1);
+        pg.with(bottom).with(top);
     }
 
-    KeyListener *listener;
-    int         action;
+    vector<Box> boxes;
+    Playground pg;
+    BotPlayer *top, *bottom;
 };
 
-/* Interface that represents a player.
- * It's common for local and remote players. It's
- * responsible to place bat and a ball in the playground.
- * It also handles network communication if applicable.
- *  initPlayer() called by playground asking to add objects
- *               to it.
- *  timePassed() called by playground each iteration of main
- *               loop. It passes position of opponents bat and
- *               asks position of this player's bat. It is an
- *               interface for network communication. It is
- *               called only if wantsUpdates() returns true.
- */
-class Player {
-    public:
-    virtual ~Player() {};
-    virtual void initPlayer(Playground &pg) = 0;
-    virtual Point timePassed(Point other) = 0;
-    virtual bool wantsUpdates() {return false;}
-    virtual Point getPos() = 0;
-    virtual void setPos(Point pos) = 0;
-    virtual void loose() = 0;
-};
-
-// Exception thrown when trying to add third player.
-struct TooManyPlayers {};
-
-class Playground {
-    public:
-    Playground(uint width, uint height)
-            :w(width), h(height) {
-
-        if(SDL_Init(SDL_INIT_VIDEO) < 0) fatal();
-        
-        if(SDL_CreateWindowAndRenderer(
-            width, height, 0, &window, &renderer
-        ) != 0) fatal();
-
-        newFrame();
-        show();
-
-        Point a = Point(0, 0),
-              b = Point(w, 0),
-              c = Point(w, h),
-              d = Point(0, h);
-
-        boundaries.push_back(Segment(a, b));
-        boundaries.push_back(Segment(b, c));
-        boundaries.push_back(Segment(c, d));
-        boundaries.push_back(Segment(d, a));
-    }
-
-    ~Playground() {
-        for(Player *p : players)
-            delete p;
-
-        SDL_DestroyRenderer(renderer);
-        SDL_DestroyWindow(window);
-        SDL_Quit();
-    }
-
-    Playground& with(Toy &d) {
-        toys.push_back(&d);
-        d.draw(renderer);
-        SDL_RenderPresent(renderer);
-
-        return *this;
-    }
-
-    Playground& with(optional<Player*> player) {
-        if(player) {
-            if(players.size() == 2)
-                throw TooManyPlayers();
-            
-            (*player)->initPlayer(*this);
-            players.push_back(*player);
-        }
-
-        return *this;
-    }
-
-    Playground& with(vector<Toy*> toys) {
-        for(Toy* t: toys)
-            with(*t);
+// First bot plays the top in even games, the bottom in odd ones.
+void botMatch(uint seed, double skillFirst, double skillSecond,
+              TournamentStats &stats) {
+    bool firstOnTop = seed % 2 == 0;
+    BotMatch m(headless, seed, firstOnTop? skillFirst : skillSecond,
+               firstOnTop? skillSecond : skillFirst);
+    BotPlayer *top = m.top, *bottom = m.bottom;
+
+    uint t = 0;
+    while(!m.pg.over() && t < matchTickLimit) {
+        m.pg.tick();
+        t++;
+    }
+
+    stats.games++;
+    stats.ticks += t;
+    if(top->defeated() == bottom->defeated()) {
+        stats.draws++;
+        return;
+    }
+
+    bool topWon = bottom->defeated();
+    stats.topWins += topWon;
+    if(topWon == firstOnTop)
+        stats.firstWins++;
+    else
+        stats.secondWins++;
+}
 
-        return *this;
-    }
+void tournament(uint games, double skillFirst, double skillSecond) {
+    uint workers = max(1u, thread::hardware_concurrency());
+    atomic<uint> next(0);
+    vector<TournamentStats> stats(workers);
+    vector<thread> pool;
+
+    cout << "Playing " << games << " games on " << workers
+         << " threads…" << endl;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(uint i = 0; i < workers; i++)
+        pool.push_back(thread([&, i]() {
+            uint g;
+            while((g = next++) < games)
+                botMatch(g, skillFirst, skillSecond, stats[i]);
+        }));
+
+    TournamentStats total;
+    for(uint i = 0; i < workers; i++) {
+        pool[i].join();
+        total.add(stats[i]);
+    }
+    double secs = chrono::duration<double>(
+            chrono::steady_clock::now() - start).count();
+
+    cout << "games:        " << total.games << " in " << secs << "s, "
+         << total.games / secs << " games/s, "
+         << total.ticks / secs << " ticks/s" << endl
+         << "first wins:   " << total.firstWins
+         << " (skill " << skillFirst << ")" << endl
+         << "second wins:  " << total.secondWins
+         << " (skill " << skillSecond << ")" << endl
+         << "draws:        " << total.draws << endl
+         << "won on top:   " << total.topWins << ", on the bottom: "
+         << total.games - total.draws - total.topWins << endl
+         << "ticks/game:   " << (double) total.ticks / total.games << endl;
+}
 
-    void ballInAGoal(Player *p) {
-        p->loose();
+/* Plays a bot match for given number of ticks and draws the last
+ * frame by software backend. Same seed gives the very same picture
+ * on any machine, so its checksum can serve as a golden one, see
+ * SNAPSHOT_TEST. With a recorder all the frames on the way get
+ * recorded. */
+void playSnapshot(BotMatch &m, uint ticks, FrameRecorder *rec) {
+    m.pg.recordTo(rec);
+    for(uint t = 0; t < ticks && !m.pg.over(); t++) {
+        m.pg.tick();
+        if(rec)
+            m.pg.render();
     }
 
-    void play() {
-        bool done = false;
-        bool pause = false;
-        uint last_time = SDL_GetTicks();
-        while(!done) {
-            SDL_Event e;
-            while(SDL_PollEvent(&e) != 0) {
-                if(e.type == SDL_KEYDOWN) {
-                    auto b = keyBindings.find(e.key.keysym.sym);
-                    if (b != keyBindings.end())
-                        downKeys[b->first] = b->second;
-                    else if (e.key.keysym.sym == SDLK_q)
-                        done = true;
-                    else if (e.key.keysym.sym == SDLK_ESCAPE)
-                        pause = !pause;
-                }
-
-                if(e.type == SDL_KEYUP) {
-                    auto b = downKeys.find(e.key.keysym.sym);
-                    if (b != downKeys.end()) {
-                        downKeys.erase(b);
-                    }
-                }
-            }
-
-            for(auto i = downKeys.begin(); i != downKeys.end(); i++) {
-                i->second.trigger();
-            }
-
-            if (!pause) {
-                newFrame();
-                if(players.size() == 2) {
-                    Player *a = NULL, *b = NULL;
-                    if(players.front()->wantsUpdates()) {
-                        a = players.front();
-                        b = players.back();
-                    } else if (players.back()->wantsUpdates()) {
-                        a = players.back();
-                        b = players.front();
-                    }
-
-                    if(a != NULL) {
-                        a->setPos(a->timePassed(b->getPos()));
-                    }
-                }
+    m.pg.render();
+}
 
-                for(Toy *toy : toys) {
-                    toy->timePassed(*this, 1);
-                    toy->draw(renderer);
-                }
-            }
-            show();
+void snapshot(string path, uint ticks, uint seed, FrameRecorder *rec) {
+    BotMatch m(software, seed, 0.8, 0.8);
+    playSnapshot(m, ticks, rec);
+    m.pg.frame()->savePPM(path);
+}
 
-            while(SDL_GetTicks() < last_time + 17); // aim at 60fps
-            last_time = SDL_GetTicks();
-        }
+/* Runs the relay server of up to matches matches at once, until
+ * killed. */
+void relay(uint players, uint matches) {
+    RelayServer server(players, 4242, matches);
+    cout << "Relaying matches of " << players << " players, up to "
+         << matches << " at once…" << endl;
+
+    RelayStats seen;
+    while(true) {
+        server.poll();
+        const RelayStats &now = server.stats();
+        if(now.matches != seen.matches || now.ended != seen.ended)
+            cout << now.matches - now.ended << " matches running, "
+                 << now.ended << " over" << endl;
+        seen = now;
+        SDL_Delay(1);
     }
+}
 
-    /* Collision detecting function. Route is a vector that represents
-     * movement would happend during current portion of time. r represents
-     * radious of the calling object. */
-    Collision obstacle(Segment route, uint r) {
-        optional<Point> intersection;
-        Segment *is = NULL;
-        Toy *toy = NULL;
-
-        for(Segment &s : boundaries) {
-            optional<Point> i = s.closePoint(route, r);
-            if(i && (!intersection
-                     || intersection->dist(route.a) > i->dist(route.a))) {
-                intersection = i;
-                is = &s;
-            }
-        }
-
-        for(Toy *t : toys) {
-            for(Segment &s : t->boundaries()) {
-                optional<Point> i = s.closePoint(route, r);
-                if(i && (!intersection
-                            || intersection->dist(route.a) > i->dist(route.a))) {
-                    intersection = i;
-                    is = &s;
-                    toy = t;
-                }
-            }
+/* Joins a match through relay server. Level comes up once the server
+ * gives us a seat, the game goes once all the seats are taken. All the
+ * players are added in seat order, so every client has the same game. */
+void joinRelay(string host, FrameRecorder *rec) {
+    NetClient *conn = new NetClient(host, 4242, 0);
+    cout << "Waiting for a seat…" << endl;
+
+    msg::Seat seat;
+    while(!conn->take(seat)) {
+        if(conn->progress() == linkFailed) {
+            cerr << "Connection failed: " << conn->failure() << endl;
+            delete conn;
+            return;
         }
+        SDL_Delay(5);
+    }
+
+    vector<Box> boxes(64);
+    Playground pg(800, 600);
+    pg.recordTo(rec);
+    for(uint i = 0; i < boxes.size(); i++)
+        pg.with(boxes[i].at(stockBox(i)));
+
+    RelayPlayer *me = (new RelayPlayer(conn, seat.seat, seat.players))
+                          ->withKeys(SDLK_LEFT, SDLK_RIGHT);
+    vector<Player*> seats;
+    for(uint i = 0; i < seat.players; i++)
+        seats.push_back((i == seat.seat)? me
+                            : new SeatPlayer(SeatPlace(i, seat.players)));
+    me->withSeats(seats);
+
+    for(Player *p : seats)
+        pg.with(p);
+    pg.play();
+}
 
-        if (toy) {
-            toy->collision();
-            if(toy->destroyed())
-                toys.remove(toy);
+/* Level file of width x height pixels for --level: clusters of 4x4
+ * boxes here and there, none near the bats. Same seed, same level. */
+void makeLevel(string path, uint width, uint height, uint seed) {
+    mt19937 rng(seed);
+    vector<LevelBox> boxes;
+
+    for(uint y = 150; y + 230 < height; y += 200)
+        for(uint x = 0; x + 300 <= width; x += 300) {
+            if(rng() % 3 == 0)
+                continue;
+
+            coord left = x + rng() % 100, top = y + rng() % 100;
+            uint8_t r = 60 + rng() % 196, g = 60 + rng() % 196,
+                    b = 60 + rng() % 196;
+            for(uint i = 0; i < 16; i++)
+                boxes.push_back(LevelBox{left + 50 * (coord)(i % 4),
+                                         top + 20 * (coord)(i / 4), r, g, b});
         }
 
-        if(intersection)
-            return Collision(
-                    *intersection,
-                    (is->a.x == is->b.x)?
-                        Mov(route.a.x - route.b.x,
-                            route.b.y - route.a.y)
-                        :Mov(route.b.x - route.a.x,
-                            route.a.y - route.b.y)
-            );
-
-        return Collision();
-    }
-
-    Playground& withKey(int keysym, KeyBinding binding) {
-        keyBindings[keysym] = binding;
-
-        return *this;
-    }
-
-    protected:
-    void newFrame() {
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, SDL_ALPHA_OPAQUE);
-        SDL_RenderClear(renderer);
-    }
+    LevelFile::write(path, width, height, 400, boxes);
+}
 
-    void show() {
-        SDL_RenderPresent(renderer);
-    }
+/* Plays a level file against a bot. Window follows our bat, boxes
+ * come and go as it moves, see StreamedLevel. */
+void playLevel(string path, FrameRecorder *rec) {
+    // a broken file is told of now, not once the game goes
+    unique_ptr<StreamedLevel> streamed;
+    try {
+        streamed.reset(new StreamedLevel(path));
+    } catch(LevelException &e) {
+        fatal(e.msg);
+    }
+    StreamedLevel &level = *streamed;
+    uint w = level.width(), h = level.height();
+
+    Player *me = (new LocalPlayer(Point(w/2 - 50, h - 50), Ball::up))
+                    ->withKeys(SDLK_LEFT, SDLK_RIGHT);
+    Player *bot = new BotPlayer(Point(w/2 - 50, 50), Ball::down,
+                                0.8, random(0, 0xffff));
+
+    Playground pg(800, 600);
+    pg.world(w, h).recordTo(rec);
+    pg.with(bot).with(me).with(level.following(me));
+    level.fill(pg);
+    pg.play();
+
+    StreamStats st = level.stats();
+    cerr << "level: " << st.loaded << " chunks streamed in, " << st.unloaded
+         << " out, " << st.waited << " waited for, at most "
+         << st.peakBoxes << " boxes in" << endl;
+}
 
-    private:
+#ifdef TOY_BENCH
+/* Compares per-kind toy loops with the virtual path, which is what
+ * every toy registered just as a Toy goes through. Headless, so
+ * only simulation is measured. */
+double benchTicks(uint cols, uint rows, uint balls, uint ticks, bool typed) {
+    Playground pg(60*cols + 400, 20*rows + 400, headless);
+
+    vector<Box> boxes(cols * rows);
+    vector<Ball> ballv;
+    vector<Bat> bats(balls);
+    for(uint i = 0; i < boxes.size(); i++)
+        boxes[i].at(Point(200 + 60*(i % cols), 200 + 20*(i / cols)));
+    for(uint i = 0; i < balls; i++) {
+        ballv.push_back(Ball().at(Point(150 + 20*i, 100 + 3*i))
+                              .moving(initialBallMovement(Ball::down)));
+        bats[i].at(Point(100 + 110*i, 20*rows + 350));
+    }
+
+    for(uint i = 0; i < boxes.size(); i++)
+        if(typed) pg.with(boxes[i]);
+        else pg.with((Toy&) boxes[i]);
+    for(uint i = 0; i < balls; i++)
+        if(typed) pg.with(ballv[i]).with(bats[i]);
+        else pg.with((Toy&) ballv[i]).with((Toy&) bats[i]);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(uint t = 0; t < ticks; t++)
+        pg.tick();
+
+    return chrono::duration<double, micro>(
+            chrono::steady_clock::now() - start).count() / ticks;
+}
 
-    uint w, h;
-    SDL_Window *window;
-    SDL_Renderer *renderer;
+/* Time to draw one frame of a level with given backend. Windowed
+ * goes last in main(), as it exits if there's no display. */
+double benchRender(Backend backend, uint cols, uint rows, uint frames) {
+    Playground pg(60*cols + 400, 20*rows + 400, backend);
 
-    list<Player*> players;
-    map<int,KeyBinding> downKeys;
-    map<int,KeyBinding> keyBindings;
-    vector<Segment> boundaries;
-    list<Toy*> toys;
-};
+    vector<Box> boxes(cols * rows);
+    vector<Ball> balls(8);
+    for(uint i = 0; i < boxes.size(); i++)
+        pg.with(boxes[i].at(Point(200 + 60*(i % cols), 200 + 20*(i / cols))));
+    for(uint i = 0; i < balls.size(); i++)
+        pg.with(balls[i].at(Point(100 + 25*i, 100)));
 
-class Ball : public Toy {
-    public:
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(uint f = 0; f < frames; f++)
+        pg.render();
 
-    void draw(SDL_Renderer *renderer) {
-        if(visible) {
-            SDL_SetRenderDrawColor(renderer, red, green, blue, 255);    
-
-            for(uint dy = 1; dy < r; dy++) {
-                /* Draw circle line by line.
-                 *
-                 * Formula (for point 0,0) is: r^2 = x^2 + y^2
-                 *
-                 * now we have y and r known, so:
-                 * x = +/- sqrt(r^2 - y^2)
-                 *
-                 * Of course we have to apply offset (x,y),
-                 * so I operate on dx and dy rather than x & y.*/
-
-                uint dx = floor(sqrt(r*r - dy*dy));
-                SDL_RenderDrawLine(renderer,
-                        pos.x - dx, pos.y - dy, pos.x + dx, pos.y - dy
-                        );
-                SDL_RenderDrawLine(renderer,
-                        pos.x - dx, pos.y + dy, pos.x + dx, pos.y + dy
-                        );
-            }
+    return chrono::duration<double, micro>(
+            chrono::steady_clock::now() - start).count() / frames;
+}
 
-            SDL_RenderDrawLine(renderer, pos.x - r, pos.y, pos.x + r, pos.y);
-        }
-    }
-    
-    void timePassed(Playground &pg, uint dt) {
-        if(visible) {
-            Point dest = velocity.apply(pos);
-
-            Collision c = pg.obstacle(Segment(pos, dest), r);
-            if(!c.really) {
-                pos = dest;
-            } else {
-                pos = c.continuation.apply(c.where);
-                velocity = c.continuation;
-            }
+/* Bot match on a level file, either streamed or with all of its boxes
+ * in from the start. Window follows the bottom bat. Returns us/tick,
+ * where the balls ended and stats of the streaming, if any. */
+double benchLevel(string path, bool streamed, uint ticks,
+                  vector<Point> &balls, StreamStats &st) {
+    StreamedLevel level(path);
+    LevelFile file(path);
+    uint w = file.width(), h = file.height();
+
+    Playground pg(800, 600, headless);
+    pg.world(w, h);
+    BotPlayer *top = new BotPlayer(Point(w/2 - 50, 50), Ball::down, 0.9, 1),
+              *bottom = new BotPlayer(Point(w/2 - 50, h - 50), Ball::up, 0.9, 2);
+    pg.with(top).with(bottom);
+
+    vector<LevelBox> read;
+    vector<Box> all;
+    if(streamed) {
+        pg.with(level.following(bottom));
+        level.fill(pg);
+    } else {
+        uint n = 0;
+        for(uint c = 0; c < file.chunks(); c++)
+            n += file.boxesIn(c);
+        all.resize(n);
+
+        n = 0;
+        for(uint c = 0; c < file.chunks(); c++) {
+            file.read(c, read);
+            for(LevelBox &l : read)
+                pg.with(all[n++].at(Point(l.x, l.y)).painted(l.r, l.g, l.b));
         }
     }
 
-    Ball& at(Point p) {
-        pos = p;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(uint t = 0; t < ticks; t++)
+        pg.tick();
+    double us = chrono::duration<double, micro>(
+            chrono::steady_clock::now() - start).count() / ticks;
 
-        return *this;
-    }
+    balls.clear();
+    for(Ball *b : pg.balls())
+        balls.push_back(b->getPos());
+    st = level.stats();
 
-    Ball& moving(Mov m) {
-        velocity = m;
-
-        return *this;
-    }
-
-    void hide() {
-        visible = false;
-        moving(Mov(0,0));
-    }
+    return us;
+}
 
-    enum Direction {
-        up = -1, down = 1
+/* Streamed levels should cost the same per tick however big they
+ * are, and play just like the whole level would. */
+void benchStream() {
+    struct { uint width, height; } sizes[] = {
+        {4000, 1200}, {16000, 2400}, {64000, 4800}
     };
+    const uint ticks = 6000;
+
+    for(auto &size : sizes) {
+        makeLevel("bench.lvl", size.width, size.height, 1);
+        uint boxes = 0;
+        LevelFile file("bench.lvl");
+        for(uint c = 0; c < file.chunks(); c++)
+            boxes += file.boxesIn(c);
+
+        vector<Point> streamedBalls, wholeBalls;
+        StreamStats st, none;
+        double streamed = benchLevel("bench.lvl", true, ticks, streamedBalls, st),
+               whole = benchLevel("bench.lvl", false, ticks, wholeBalls, none);
+
+        bool same = streamedBalls.size() == wholeBalls.size();
+        for(uint i = 0; same && i < wholeBalls.size(); i++)
+            same = streamedBalls[i].x == wholeBalls[i].x
+                && streamedBalls[i].y == wholeBalls[i].y;
+
+        cout << "level " << size.width << "x" << size.height << ", "
+             << boxes << " boxes: streamed " << streamed << " us/tick, whole "
+             << whole << " us/tick; at most " << st.peakBoxes << " boxes in, "
+             << st.loaded << " chunks in, " << st.unloaded << " out, "
+             << st.waited << " waited for; plays "
+             << (same? "the same" : "DIFFERENTLY") << endl;
+    }
+    remove("bench.lvl");
+}
 
-    private:
-    uint    red = 0xff, green = 0xff, blue=0, r=10;
-    Point   pos = Point(400,300);
-    Mov     velocity = Mov(0,0);
-    bool    visible = true;
-};
-
-class Box : public Toy {
-    public:
-    Box() {
-        r = random(10,255);
-        g = random(10,255);
-        b = random(10,255);
-
-        refresh();
-    }
-
-    ~Box(){}
-
-    Box &at(Point p) {
-        pos = p;
-        refresh();
-
-        return *this;
-    }
-
-    void draw(SDL_Renderer *renderer) {
-        SDL_Rect rect;
-        rect.x = pos.x;
-        rect.y = pos.y;
-        rect.w = w;
-        rect.h = h;
-
-        SDL_SetRenderDrawColor(renderer, r, g, b, 255);
-        SDL_RenderFillRect(renderer, &rect);
-    }
-
-    void collision() {
-        hits++;
-        r = random(10,255);
-        g = random(10,255);
-        b = random(10,255);
-    }
-
-    bool destroyed() { return hits >= 2; }
-    
-    void timePassed(Playground &pg, uint dt) {
-    }
+/* Level of cols x rows boxes at the top, open field under it, lots of
+ * balls in it and two bots. Returns us/tick, end is state() and where
+ * the balls are once done, to compare kinetic mode with the usual. */
+double benchKinetic(uint cols, uint rows, uint balls, uint ticks,
+                    bool kinetic, string &end) {
+    uint w = 60*cols + 400, h = 20*rows + 1000;
+    Playground pg(w, h, headless);
+    pg.kinetic(kinetic);
+
+    mt19937 rng(5);
+    vector<Box> boxes(cols * rows);
+    vector<Ball> ballv(balls);
+    for(uint i = 0; i < boxes.size(); i++)
+        pg.with(boxes[i].at(Point(200 + 60*(i % cols), 200 + 20*(i / cols))));
+    for(Ball &b : ballv) {
+        coord dx = (coord)(rng() % 11) - 5,
+              dy = ((rng() % 2)? 1 : -1) * (6 - abs(dx) / 2);
+        pg.with(b.at(Point(50 + rng() % (w - 100), 20*rows + 300 + rng() % 500))
+                 .moving(Mov(dx, dy)));
+    }
+    pg.with(new BotPlayer(Point(w/2, 50), Ball::down, 0.9, 1))
+      .with(new BotPlayer(Point(w/2, h - 50), Ball::up, 0.9, 2));
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(uint t = 0; t < ticks; t++)
+        pg.tick();
+    double us = chrono::duration<double, micro>(
+            chrono::steady_clock::now() - start).count() / ticks;
+
+    end = pg.state();
+    for(Ball *b : pg.balls())
+        end += b->getPos().bin();
+
+    return us;
+}
 
-    private:
-    
-    void refresh() {
-        bounds.clear();
-        Point a(pos.x,      pos.y),
-              b(pos.x + w,  pos.y),
-              c(pos.x + w,  pos.y + h),
-              d(pos.x,      pos.y + h);
-
-        bounds.push_back(Segment(a, b));
-        bounds.push_back(Segment(b, c));
-        bounds.push_back(Segment(c, d));
-        bounds.push_back(Segment(d, a));
-    }
-
-    Point   pos = Point(0,0);
-    uint    w = 50, h = 20;
-    uint    r, g, b;
-    uint    hits = 0;
+/* One side of a match without network: level of cols x rows boxes,
+ * a few extra balls, two players and rollback. Bats wander at random,
+ * the same way on every side, remote inputs come lag ticks late. */
+struct RollbackSide {
+    RollbackSide(uint cols, uint rows, uint balls, bool topIsLocal)
+            : pg(60*cols + 400, 20*rows + 400, headless),
+              boxes(cols * rows), extra(balls) {
+        for(uint i = 0; i < boxes.size(); i++)
+            pg.with(boxes[i].at(Point(200 + 60*(i % cols), 200 + 20*(i / cols))));
+        for(uint i = 0; i < balls; i++)
+            pg.with(extra[i].at(Point(150 + 20*i, 100 + 3*i))
+                            .moving(initialBallMovement(Ball::down)));
+
+        top = (new LocalPlayer(Point(350, 50), Ball::down))->withKeys(-1, -2);
+        bottom = (new LocalPlayer(Point(350, 20*rows + 350), Ball::up))
+                    ->withKeys(-1, -2);
+        pg.with(optional<Player*>(top)).with(optional<Player*>(bottom));
+
+        local = topIsLocal? top : bottom;
+        remote = topIsLocal? bottom : top;
+        rb = new Rollback(pg, *remote);
+    }
+    ~RollbackSide() { delete rb; }
+
+    // Plays tick t, remote input for t - lag comes after it.
+    void tick(uint t, const vector<coord> &localX,
+              const vector<coord> &remoteX, uint lag) {
+        if(lag == 0)
+            rb->remoteInput(t, remoteX[t]);
+        local->setPos(Point(localX[t], local->getPos().y));
+        remote->setPos(rb->advance(*local));
+        pg.step();
+        if(lag > 0 && t >= lag)
+            rb->remoteInput(t - lag, remoteX[t - lag]);
+    }
+
+    // Remaining inputs come, game is put right.
+    void finish(uint ticks, const vector<coord> &remoteX) {
+        for(uint t = 0; t < ticks; t++)
+            rb->remoteInput(t, remoteX[t]);
+        rb->correct(*local);
+    }
+
+    Playground pg;
+    vector<Box> boxes;
+    vector<Ball> extra;
+    Player *top, *bottom, *local, *remote;
+    Rollback *rb;
 };
 
-class Bat : public Toy, public KeyListener {
-    public:
-    Bat() {
-        refresh();
-    }
-
-    ~Bat() {}
-
-    void timePassed(Playground &pg, uint dt) {}
-    void draw(SDL_Renderer *renderer) {
-        if(visible) {
-            SDL_Rect rect;
-            rect.x = pos.x;
-            rect.y = pos.y;
-            rect.w = w;
-            rect.h = h;
-
-            SDL_SetRenderDrawColor(renderer, r, g, b, 255);
-            SDL_RenderFillRect(renderer, &rect);
-        }
-    }
-
-    Bat &at(Point p) {
-        pos = p;
-        refresh();
-
-        return *this;
-    }
-
-    void refresh() {
-        bounds.clear();
-        Point a(pos.x,      pos.y),
-              b(pos.x + w,  pos.y),
-              c(pos.x + w,  pos.y + h),
-              d(pos.x,      pos.y + h);
-
-        bounds.push_back(Segment(a, b));
-        bounds.push_back(Segment(b, c));
-        bounds.push_back(Segment(c, d));
-        bounds.push_back(Segment(d, a));
+static vector<coord> wander(uint ticks, uint seed, uint width) {
+    mt19937 rng(seed);
+    vector<coord> x(ticks);
+    coord pos = 350;
+    for(uint t = 0; t < ticks; t++) {
+        pos = max(0, min((coord) width - 100, pos + 7 * ((coord)(rng() % 3) - 1)));
+        x[t] = pos;
     }
 
-    void keyPress(int action) {
-        switch(action) {
-            case moveLeft:
-                pos.x -= 7;
-                break;
-            case moveRight:
-                pos.x += 7;
-        }
-
-        refresh();
-    }
+    return x;
+}
 
-    void hide() {
-        bounds.clear();
-        visible = false;
+/* Both sides of a match, inputs lag ticks late each way, must end up
+ * where the game with no lag does. Then one side alone measures what
+ * a tick costs with that much rolling back. */
+void benchRollback(const char *name, uint cols, uint rows, uint balls,
+                   uint ticks) {
+    uint width = 60*cols + 400;
+    vector<coord> topX = wander(ticks, 1, width),
+                  bottomX = wander(ticks, 2, width);
+
+    RollbackSide exact(cols, rows, balls, true),
+                 a(cols, rows, balls, true),
+                 b(cols, rows, balls, false);
+    const uint lag = 6;
+    for(uint t = 0; t < ticks; t++) {
+        exact.tick(t, topX, bottomX, 0);
+        a.tick(t, topX, bottomX, lag);
+        b.tick(t, bottomX, topX, lag);
+    }
+    a.finish(ticks, bottomX);
+    b.finish(ticks, topX);
+
+    bool same = a.pg.state() == exact.pg.state()
+             && b.pg.state() == exact.pg.state();
+    cout << name << ": sides " << (same? "agree" : "DIFFER") << " after "
+         << ticks << " ticks, " << lag << " ticks of lag" << endl;
+
+    /* Inputs 2 to 12 ticks late, each its own: biggest step of the
+     * remote bat from frame to frame, simulated and drawn. Bats move
+     * 7 a tick, anything over that is a jump. */
+    RollbackSide jittery(cols, rows, balls, true);
+    mt19937 rng(3);
+    vector<vector<uint> > arriving(ticks + 13);
+    for(uint t = 0; t < ticks; t++)
+        arriving[t + 2 + rng() % 11].push_back(t);
+    coord simJump = 0, shownJump = 0;
+    optional<coord> lastSim, lastShown;
+    for(uint t = 0; t < ticks; t++) {
+        for(uint i : arriving[t])
+            jittery.rb->remoteInput(i, bottomX[i]);
+        jittery.local->setPos(Point(topX[t], jittery.local->getPos().y));
+        jittery.remote->setPos(jittery.rb->advance(*jittery.local));
+        jittery.pg.step();
+
+        coord sim = jittery.remote->getPos().x;
+        optional<coord> shown = jittery.rb->shownX();
+        if(lastSim)
+            simJump = max(simJump, abs(sim - *lastSim));
+        if(lastShown && shown)
+            shownJump = max(shownJump, abs(*shown - *lastShown));
+        lastSim = sim;
+        lastShown = shown;
+    }
+    cout << name << ": with jitter remote bat steps up to " << simJump
+         << " simulated, " << shownJump << " drawn" << endl;
+
+    RollbackSide side(cols, rows, balls, true);
+    Playground::Snapshot snap;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(uint i = 0; i < 1000; i++)
+        side.pg.save(snap);
+    double save = chrono::duration<double, micro>(
+            chrono::steady_clock::now() - start).count() / 1000;
+    start = chrono::steady_clock::now();
+    for(uint i = 0; i < 1000; i++)
+        side.pg.restore(snap);
+    double restore = chrono::duration<double, micro>(
+            chrono::steady_clock::now() - start).count() / 1000;
+
+    double base = 0;
+    cout << "  snapshot save " << save << " us, restore " << restore << " us"
+         << endl;
+    for(uint lag : {0, 2, 8, 32}) {
+        RollbackSide s(cols, rows, balls, true);
+        start = chrono::steady_clock::now();
+        for(uint t = 0; t < ticks; t++)
+            s.tick(t, topX, bottomX, lag);
+        double us = chrono::duration<double, micro>(
+                chrono::steady_clock::now() - start).count() / ticks;
+        double replayed = (double) s.rb->replayed() / ticks;
+        if(lag == 0)
+            base = us;
+
+        cout << "  lag " << lag << ": " << us << " us/tick, "
+             << replayed << " ticks replayed per tick";
+        if(replayed > 0)
+            cout << ", affords " << (1e6 / 60 - base) / ((us - base) / replayed)
+                 << " replayed ticks per 60Hz frame";
+        cout << endl;
     }
+}
 
-    Point getPos() { return pos; }
-
-    enum Actions {
-        moveLeft, moveRight
+int main(int argc, char **argv) {
+    struct { const char *name; uint cols, rows, balls, ticks; } fields[] = {
+        {"stock 8x8, 16 balls",      8,   8,  16, 5000},
+        {"large 60x50, 64 balls",   60,  50,  64,  500},
+        {"large 60x50, 512 balls",  60,  50, 512,  100},
+        {"huge 200x150, 64 balls", 200, 150,  64,   50}
+    };
+    for(auto &f : fields) {
+        string usual, kinetic;
+        double a = benchKinetic(f.cols, f.rows, f.balls, f.ticks, false, usual),
+               b = benchKinetic(f.cols, f.rows, f.balls, f.ticks, true, kinetic);
+        cout << "kinetic, " << f.name << ": every tick " << a
+             << " us/tick, kinetic " << b << " us/tick (" << a / b << "x), "
+             << ((usual == kinetic)? "same game" : "DIFFERENT GAME") << endl;
+    }
+
+    benchStream();
+    benchRollback("rollback, stock 8x8", 8, 8, 0, 3000);
+    benchRollback("rollback, large 60x50, 2 balls", 60, 50, 2, 1000);
+    benchRollback("rollback, huge 200x150, 2 balls", 200, 150, 2, 100);
+
+    struct { const char *name; uint cols, rows, balls, ticks; } levels[] = {
+        {"stock 8x8, 2 balls",        8,   8,  2, 20000},
+        {"large 60x50, no balls",    60,  50,  0, 20000},
+        {"large 60x50, 2 balls",     60,  50,  2,  2000},
+        {"large 60x50, 32 balls",    60,  50, 32,   200},
+        {"huge 200x150, 2 balls",   200, 150,  2,   200}
     };
 
-    private:
-    Point   pos = Point(350,750);
-    uint    w = 100, h=10;
-    uint    r = 150, g = 150, b = 150;
-    bool    visible = true;
-};
-
-Mov initialBallMovement(Ball::Direction direction) {
-    int dx = 3;
-    int dy = direction * (6 - abs(dx));
-    return Mov(dx, dy);
+    for(auto &l : levels) {
+        double virt = benchTicks(l.cols, l.rows, l.balls, l.ticks, false),
+               typed = benchTicks(l.cols, l.rows, l.balls, l.ticks, true);
+        cout << l.name << ": virtual " << virt << " us/tick, per-kind "
+             << typed << " us/tick (" << virt / typed << "x)" << endl;
+    }
+
+    cout << "render stock 8x8, software: "
+         << benchRender(software, 8, 8, 5000) << " us/frame" << endl
+         << "render large 60x50, software: "
+         << benchRender(software, 60, 50, 500) << " us/frame" << endl;
+    cout << "render stock 8x8, windowed: "
+         << benchRender(windowed, 8, 8, 500) << " us/frame" << endl
+         << "render large 60x50, windowed: "
+         << benchRender(windowed, 60, 50, 100) << " us/frame" << endl;
 }
+#elif defined(ALLOC_TEST)
+/* Once the game has settled a frame must not touch the heap. A bot
+ * match, drawn by software backend, goes for a while, then every frame
+ * after that is checked. Fails telling what allocated, if anything. */
+int main(int argc, char **argv) {
+    uint warmup = 300, frames = (argc > 1)? atoi(argv[1]) : 3000;
 
-class Goal : public Toy {
-    public:
-    Goal(Playground &pg, Player *player, Ball::Direction side)
-            : pg(pg), player(player) {
-        switch(side) {
-            case Ball::up:
-                bounds.push_back(Segment(Point(0, 590), Point(800, 590)));
-                break;
-            case Ball::down:
-                bounds.push_back(Segment(Point(0, 10), Point(800, 10)));
-                break;
-        }
-    }
-
-    void draw(SDL_Renderer *r) {}
-    void timePassed(Playground &pg, uint dt) {}
-    void collision() {
-        pg.ballInAGoal(player);
-    }
-    bool destroyed() { return false; }
-
-    private:
-    Playground &pg;
-    Player *player;
-};
-
-class GenericPlayer : public Player {
-    public:
-    GenericPlayer(Point position, Ball::Direction direction) 
-            :dir(direction), position(position) {
-        ball = Ball().at(Mov(0, direction * 50).apply(position))
-                     .moving(initialBallMovement(direction));
-        bat = Bat().at(position);
-    }
-    ~GenericPlayer(){
-        if(goal) delete goal;
-    }
-
-    Point getPos() { return bat.getPos(); };
-    void setPos(Point pos) { bat.at(pos); }
-
-    void loose() {
-        if(chances-- <= 0) {
-            ball.hide();
-            bat.hide();
-        }
+    BotMatch m(software, 3, 0.8, 0.8);
+    for(uint t = 0; t < warmup; t++) {
+        m.pg.tick();
+        m.pg.render();
     }
 
-    protected:
-    Bat bat;
-    Ball ball;
-    Goal *goal = NULL;
-    Ball::Direction dir;
-    Point position;
-    int chances = 3;
-};
-
-class LocalPlayer : public GenericPlayer {
-    public:
-    LocalPlayer(Point p, Ball::Direction d) : GenericPlayer(p, d) {}
-    ~LocalPlayer() {};
+    alloc::frame();
+    uint played = 0, bad = 0;
+    alloc::Frame sum = alloc::Frame();
+    for(; played < frames && !m.pg.over(); played++) {
+        m.pg.tick();
+        m.pg.render();
 
-    LocalPlayer *withKeys(int moveLeft, int moveRight) {
-        lKey = moveLeft;
-        rKey = moveRight;
-
-        return this;
+        alloc::Frame f = alloc::frame();
+        if(f.allocs[alloc::subsystems])
+            bad++;
+        for(uint s = 0; s <= alloc::subsystems; s++)
+            sum.allocs[s] += f.allocs[s];
+        sum.live = f.live;
+        sum.peak = f.peak;
     }
 
-    void initPlayer(Playground &pg) {
-        pg.with(ball).with(bat).with(*(goal = new Goal(pg, this, dir)))
-            .withKey(lKey, KeyBinding(&bat, (int)Bat::moveLeft))
-            .withKey(rKey, KeyBinding(&bat, (int)Bat::moveRight));
-    }
+    alloc::reportFrame(cout, sum, played);
+    cout << bad << " of " << played << " frames allocated" << endl;
 
-    Point timePassed(Point other) {
-        return Point(0,0);
+    return bad? 1 : 0;
+}
+#elif defined(SNAPSHOT_TEST)
+
+/* Stock level after 600 ticks of a bot match of seed 0 must come out
+ * of the software backend pixel for pixel as it did when golden was
+ * taken: FNV-1a of the frame's red, green and blue bytes, row by row.
+ * When a change is meant to alter the picture, look at it first with
+ * b-out --snapshot stock.ppm 600 0, then put in what this prints. */
+int main() {
+    const uint w = 800, h = 600;
+    const uint64_t golden = 0x0aef35711ad83c97ull;
+
+    BotMatch m(software, 0, 0.8, 0.8);
+    playSnapshot(m, 600, NULL);
+    const FrameBuffer &fb = *m.pg.frame();
+    if(fb.width() != w || fb.height() != h) {
+        cout << "drawn " << fb.width() << "x" << fb.height() << ", golden is "
+             << w << "x" << h << endl;
+        return 1;
+    }
+
+    uint64_t hash = 1469598103934665603ull;
+    for(uint i = 0; i < w * h; i++) {
+        const uint8_t *p = (const uint8_t *) &fb.pixels()[i];
+        for(uint c = 0; c < 3; c++)
+            hash = (hash ^ p[c]) * 1099511628211ull;
+    }
+
+    if(hash != golden)
+        cout << "frame is 0x" << hex << hash << ", golden 0x" << golden
+             << dec << endl;
+    else
+        cout << "same as golden" << endl;
+
+    return (hash != golden)? 1 : 0;
+}
+#else
+int main(int argc, char **argv) {
+    FrameRecorder *recorder = NULL;
+    if(argc > 2 && strcmp(argv[1], "--record") == 0) {
+        recorder = new FrameRecorder(argv[2], 800, 600);
+        argc -= 2;
+        argv += 2;
     }
 
-    private:
-    int lKey, rKey;
-};
-
-class RemotePlayer : public GenericPlayer {
-    public:
-    RemotePlayer(Point position, Ball::Direction direction)
-        : GenericPlayer (position, direction) {}
-    ~RemotePlayer() {}
-
-    bool wantsUpdates() {return true;}
-
-    void initPlayer(Playground &pg) {
-        pg.with(ball).with(bat).with(*(goal = new Goal(pg, this, dir)));
+    if(argc > 1) {
+       if(strcmp(argv[1], "--tournament") == 0) {
+           tournament((argc > 2)? atoi(argv[2]) : 1000,
+                      (argc > 3)? atof(argv[3]) : 0.8,
+                      (argc > 4)? atof(argv[4]) : 0.8);
+           return 0;
+       } else if(strcmp(argv[1], "--snapshot") == 0 && argc > 2) {
+           snapshot(argv[2], (argc > 3)? atoi(argv[3]) : 600,
+                    (argc > 4)? atoi(argv[4]) : 0, recorder);
+           if(recorder) {
+               printRecorderStats(*recorder);
+               delete recorder;
+           }
+           return 0;
+       } else if(strcmp(argv[1], "--unpack") == 0 && argc > 3) {
+           unpack(argv[2], argv[3]);
+           return 0;
+       } else if(strcmp(argv[1], "--make-level") == 0 && argc > 2) {
+           makeLevel(argv[2], (argc > 3)? atoi(argv[3]) : 16000,
+                     (argc > 4)? atoi(argv[4]) : 1200,
+                     (argc > 5)? atoi(argv[5]) : 0);
+           return 0;
+       } else if(strcmp(argv[1], "--level") == 0 && argc > 2) {
+           playLevel(argv[2], recorder);
+           if(recorder) {
+               printRecorderStats(*recorder);
+               delete recorder;
+           }
+           return 0;
+       } else if(strcmp(argv[1], "--relay") == 0) {
+           relay((argc > 2)? atoi(argv[2]) : 4,
+                 (argc > 3)? atoi(argv[3]) : 64);
+           return 0;
+       } else if(strcmp(argv[1], "--join") == 0 && argc > 2) {
+           joinRelay(argv[2], recorder);
+           if(recorder) {
+               printRecorderStats(*recorder);
+               delete recorder;
+           }
+           return 0;
+       } else if(strcmp(argv[1], "--server") == 0)
+           mode = server;
+       else if(strcmp(argv[1], "--localmulti") == 0)
+           mode = localmulti;
+       else if(strcmp(argv[1], "--bot") == 0)
+           mode = bot;
+       else if(strcmp(argv[1], "--spectate") == 0 && argc > 2) {
+           SpectatorView view(new SpectatorClient(argv[2]));
+           Playground(800,600).recordTo(recorder).with(view).play();
+           return 0;
+       }
+       else
+           mode = client;
     }
-};
 
-class GuestRemote : public RemotePlayer {
-    public:
-    GuestRemote(NetServer *conn, Point position, Ball::Direction direction)
-        : RemotePlayer (position, direction), conn(conn) {}
-    ~GuestRemote() { delete conn; }
+    // connecting starts first, window and level come up meanwhile
+    optional<Player*> second = playerForMode(mode, argv[1]);
 
-    Point timePassed(Point other) {
-        conn->send(other.bin());
-        return Point(conn->receive());
-    }
+    vector<Box*> boxes;
+    for(uint i = 0; i < 64; i++)
+        boxes.push_back(&((new Box())->at(stockBox(i))));
 
-    private:
-    NetServer *conn;
-};
+    SpectatorHub *hub = (mode == server)? new SpectatorHub() : NULL;
 
-class HostRemote : public RemotePlayer {
-    public:
-    HostRemote(NetClient *conn, Point position, Ball::Direction direction)
-       : RemotePlayer(position, direction), conn(conn) {} 
-    ~HostRemote() { delete conn; }
+    Player *me = ((mode == client)?
+                      new LocalPlayer(Point(350,50), Ball::down)
+                      :new LocalPlayer(Point(350,550), Ball::up))
+                    ->withKeys(SDLK_LEFT, SDLK_RIGHT);
 
-    Point timePassed(Point other) {
-        Point resp = Point(conn->receive());
-        conn->send(other.bin());
-        return resp;
-    }
+    Playground playground(800,600);
+    playground.recordTo(recorder)
+              .spectatedBy(hub)
+              .with(boxes);
 
-    private:
-    NetClient *conn;
-};
+    // both sides of a network game need toys in the same order
+    if(mode == server)
+        playground.with(second).with(me);
+    else
+        playground.with(me).with(second);
 
-enum Mode {
-    server, client, localmulti, single
-} mode = single;
+    playground.play();
 
-/* This function decides if there should be second player and
- * constructs its object depending on game mode. */
-optional<Player*> playerForMode(Mode m, char *arg) {
-    switch(m) {
-        case server:
-            cout << "Waiting for second player…" << endl;
-            return optional<Player*>(
-                    new GuestRemote(
-                            new NetServer(),
-                            Point(350, 50),
-                            Ball::down
-                    )
-            );
-        case localmulti:
-            return optional<Player*>(
-                    (new LocalPlayer(Point(350, 50), Ball::down))
-                        ->withKeys(SDLK_a, SDLK_d)
-            );
-        case client:
-            return optional<Player*>(
-                    new HostRemote(
-                            new NetClient(string(arg)),
-                            Point(350, 550),
-                            Ball::up
-                    )
-            );
-        default:
-            return optional<Player*>();
+    if(hub) {
+        SpectatorStats st = hub->stats();
+        cerr << "spectators: " << st.spectators << ", sent " << st.packets
+             << " packets, " << st.bytes / 1024 << "KiB" << endl;
+        delete hub;
     }
-}
 
-int main(int argc, char **argv) {
-    if(argc > 1) {
-       if(strcmp(argv[1], "--server") == 0)
-           mode = server;
-       else if(strcmp(argv[1], "--localmulti") == 0)
-           mode = localmulti;
-       else
-           mode = client;
+    if(recorder) {
+        printRecorderStats(*recorder);
+        delete recorder;
     }
 
-    vector<Toy*> boxes;
-    for(uint x = 0; x < 8; x++)
-        for(uint y = 0; y < 8; y++){
-            Box *b = new Box();
-
-            boxes.push_back(&(b->at(Point(200+50*x, 200+20*y))));
-        }
-
-    Playground playground(800,600);
-    playground.with(boxes)
-              .with(((mode == client)?
-                          new LocalPlayer(Point(350,50), Ball::down)
-                          :new LocalPlayer(Point(350,550), Ball::up))
-                        ->withKeys(SDLK_LEFT, SDLK_RIGHT))
-              .with(playerForMode(mode, argv[1]))
-              .play();
-
-    for(Toy* box : boxes)
+    for(Box* box : boxes)
         delete box;
 }
-
+#endif
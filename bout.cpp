@@ -0,0 +1,343 @@
+#include "bout.h"
+#include "game.hpp"
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+/* Bat moved by whoever calls act(), same as a key held for one tick. */
+class AgentPlayer : public GenericPlayer {
+    public:
+    AgentPlayer(Point p, Ball::Direction d) : GenericPlayer(p, d) {}
+
+    void initPlayer(Playground &pg) {
+        pg.with(ball).with(bat).with(*(goal = new Goal(pg, this, dir)));
+    }
+
+    Point timePassed(Point other) {
+        return Point(0,0);
+    }
+
+    void act(int action) {
+        if(action < 0)
+            bat.keyPress(Bat::moveLeft);
+        else if(action > 0)
+            bat.keyPress(Bat::moveRight);
+    }
+};
+
+/* One game of the batch. The start is saved as a snapshot, bot's
+ * random engine with it, so starting over is just restoring it and
+ * the game goes again as the first time; nothing gets allocated. */
+struct BatchGame {
+    BatchGame(uint seed, double skill)
+            : boxes((randomEngine().seed(seed), 64)),
+              pg(800, 600, headless) {
+        for(uint i = 0; i < boxes.size(); i++)
+            pg.with(boxes[i].at(stockBox(i)));
+
+        bottom = new AgentPlayer(Point(350, 550), Ball::up);
+        if(skill >= 0)
+            top = new BotPlayer(Point(350, 50), Ball::down, skill, seed);
+        else
+            top = agentTop = new AgentPlayer(Point(350, 50), Ball::down);
+
+        // top first, so its ball and bat come first
+        pg.with(top).with(bottom);
+        pg.save(start);
+    }
+
+    void reset() {
+        pg.restore(start);
+        ticks = 0;
+    }
+
+    void step(const int8_t *action, float *reward, uint8_t *done,
+              uint tickLimit) {
+        int topLeft = top->chancesLeft(), bottomLeft = bottom->chancesLeft();
+
+        // no actions move no bats
+        if(action) {
+            if(agentTop)
+                agentTop->act(action[0]);
+            bottom->act(action[1]);
+        }
+        pg.tick();
+        ticks++;
+
+        float r = (bottomLeft - bottom->chancesLeft())
+                - (topLeft - top->chancesLeft());
+        if(reward) {
+            reward[0] = r;
+            reward[1] = -r;
+        }
+
+        bool over = pg.over() || (tickLimit && ticks >= tickLimit);
+        if(done)
+            *done = over;
+        if(over)
+            reset();
+    }
+
+    void observe(int32_t *obs) {
+        obs[BOUT_OBS_TICK] = ticks;
+
+        int32_t *o = obs + BOUT_OBS_BATS;
+        for(Player *p : {top, (Player *) bottom}) {
+            *o++ = p->getPos().x;
+            *o++ = p->getPos().y;
+        }
+
+        obs[BOUT_OBS_CHANCES] = top->chancesLeft();
+        obs[BOUT_OBS_CHANCES + 1] = bottom->chancesLeft();
+
+        o = obs + BOUT_OBS_BALLS;
+        for(Ball *b : pg.balls()) {
+            *o++ = b->getPos().x;
+            *o++ = b->getPos().y;
+            *o++ = b->getVelocity().dx;
+            *o++ = b->getVelocity().dy;
+            *o++ = b->isVisible();
+        }
+
+        for(uint i = 0; i < boxes.size(); i++)
+            obs[BOUT_OBS_BOXES + i] = !boxes[i].destroyed();
+    }
+
+    vector<Box> boxes;
+    Playground pg;
+    Player *top;
+    AgentPlayer *agentTop = NULL, *bottom;
+    Playground::Snapshot start;
+    uint ticks = 0;
+};
+
+/* Games are cut into as many chunks as there are threads. The caller
+ * plays the first chunk, workers the others; they wait for the next
+ * round between steps, so a step starts no threads. */
+struct bout_batch {
+    bout_batch(const bout_config &c): config(c) {
+        for(uint i = 0; i < c.games; i++)
+            games.emplace_back(new BatchGame(c.seed + i, c.botSkill));
+
+        /* One that can't start must not leave the others running. Room
+         * is made first, a thread started can't get lost on the way. */
+        try {
+            workers.reserve(max(c.threads, 1u) - 1);
+            for(uint w = 1; w < max(c.threads, 1u); w++)
+                workers.push_back(thread(&bout_batch::work, this, w));
+        } catch(...) {
+            stop();
+            throw;
+        }
+    }
+
+    ~bout_batch() {
+        stop();
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> l(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(thread &t : workers)
+            t.join();
+    }
+
+    void round(bool reset, const int8_t *a, int32_t *o, float *r,
+               uint8_t *d) {
+        resetting = reset;
+        actions = a;
+        obs = o;
+        rewards = r;
+        done = d;
+
+        {
+            lock_guard<mutex> l(lock);
+            generation++;
+            busy = workers.size();
+        }
+        wake.notify_all();
+
+        play(0);
+
+        unique_lock<mutex> l(lock);
+        finished.wait(l, [&]() { return busy == 0; });
+    }
+
+    void work(uint chunk) {
+        uint seen = 0;
+        while(true) {
+            {
+                unique_lock<mutex> l(lock);
+                wake.wait(l, [&]() { return stopping || generation != seen; });
+                if(stopping)
+                    return;
+                seen = generation;
+            }
+
+            play(chunk);
+
+            lock_guard<mutex> l(lock);
+            if(--busy == 0)
+                finished.notify_one();
+        }
+    }
+
+    // Steps games of the chunk, or only resets them.
+    void play(uint chunk) {
+        uint n = games.size(), chunks = workers.size() + 1,
+             from = n * chunk / chunks, to = n * (chunk + 1) / chunks;
+
+        for(uint i = from; i < to; i++) {
+            BatchGame &g = *games[i];
+            if(resetting)
+                g.reset();
+            else
+                g.step(actions? actions + 2 * i : NULL,
+                       rewards? rewards + 2 * i : NULL,
+                       done? done + i : NULL, config.tickLimit);
+
+            if(obs)
+                g.observe(obs + BOUT_OBS_SIZE * i);
+        }
+    }
+
+    bout_config config;
+    vector<unique_ptr<BatchGame> > games;
+
+    bool resetting = false;
+    const int8_t *actions = NULL;
+    int32_t *obs = NULL;
+    float *rewards = NULL;
+    uint8_t *done = NULL;
+
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake, finished;
+    uint generation = 0, busy = 0;
+    bool stopping = false;
+};
+
+extern "C" {
+
+bout_batch *bout_create(const bout_config *config) {
+    if(!config || config->games == 0)
+        return NULL;
+
+    try {
+        return new bout_batch(*config);
+    } catch(...) {
+        return NULL;
+    }
+}
+
+void bout_destroy(bout_batch *batch) {
+    delete batch;
+}
+
+void bout_reset(bout_batch *batch, int32_t *obs) {
+    batch->round(true, NULL, obs, NULL, NULL);
+}
+
+void bout_step(bout_batch *batch, const int8_t *actions, int32_t *obs,
+               float *rewards, uint8_t *done) {
+    batch->round(false, actions, obs, rewards, done);
+}
+
+}
+
+#ifdef BOUT_BENCH
+#include <chrono>
+
+/* Steps per second through the C interface, for a few batch sizes,
+ * random actions, bottom bat by actions, top one by a bot. Then the
+ * same batch made twice must play the very same games, also once one
+ * of them has played a while and was reset. */
+int main(int argc, char **argv) {
+    uint threads = (argc > 1)? atoi(argv[1]) : thread::hardware_concurrency();
+    mt19937 rng(1);
+
+    for(uint games : {1, 64, 1024}) {
+        bout_config c = {games, 0, threads, 18000, 0.8f};
+        bout_batch *batch = bout_create(&c);
+
+        const uint variants = 16;
+        vector<int8_t> actions(variants * 2 * games);
+        for(int8_t &a : actions)
+            a = (int8_t)(rng() % 3) - 1;
+        vector<int32_t> obs(BOUT_OBS_SIZE * games);
+        vector<float> rewards(2 * games);
+        vector<uint8_t> done(games);
+
+        bout_reset(batch, obs.data());
+        uint calls = max(20000u / games, 20u);
+        unsigned long long ended = 0;
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for(uint i = 0; i < calls; i++) {
+            bout_step(batch, &actions[(i % variants) * 2 * games], obs.data(),
+                      rewards.data(), done.data());
+            for(uint8_t d : done)
+                ended += d;
+        }
+        double secs = chrono::duration<double>(
+                chrono::steady_clock::now() - start).count();
+
+        cout << games << " games, " << max(threads, 1u) << " threads: "
+             << (double) calls * games / secs / 1e6 << "M steps/s, "
+             << 1e6 * secs / calls << " us per call, "
+             << ended << " games ended" << endl;
+
+        bout_destroy(batch);
+    }
+
+    for(float skill : {-1.0f, 0.8f}) {
+        bout_config c = {64, 7, threads, 0, skill};
+        bout_batch *a = bout_create(&c), *b = bout_create(&c);
+        vector<int8_t> actions(2 * 64);
+        vector<int32_t> obsA(BOUT_OBS_SIZE * 64), obsB(BOUT_OBS_SIZE * 64);
+        bool same = true, sameReset = true;
+        for(uint t = 0; t < 10000; t++) {
+            for(int8_t &x : actions)
+                x = (int8_t)(rng() % 3) - 1;
+            if(t == 5000) {
+                bout_reset(a, obsA.data());
+                bout_destroy(b);
+                b = bout_create(&c);
+            }
+            bout_step(a, actions.data(), obsA.data(), NULL, NULL);
+            bout_step(b, actions.data(), obsB.data(), NULL, NULL);
+            (t < 5000? same : sameReset) &= obsA == obsB;
+        }
+        cout << (skill < 0? "agents" : "bot and agent")
+             << ": two batches with the same seed and actions "
+             << (same? "agree" : "DIFFER") << ", reset one and a new one "
+             << (sameReset? "agree" : "DIFFER") << endl;
+
+        bout_destroy(a);
+        bout_destroy(b);
+    }
+
+    bout_config none = {0, 7, threads, 0, -1};
+    cout << "no config and no games " << (!bout_create(NULL)
+            && !bout_create(&none)? "refused" : "ACCEPTED") << endl;
+
+    bout_config c = {4, 7, threads, 0, 0.8f};
+    bout_batch *a = bout_create(&c), *b = bout_create(&c);
+    vector<int8_t> zeros(2 * 4, 0);
+    vector<int32_t> obsA(BOUT_OBS_SIZE * 4), obsB(BOUT_OBS_SIZE * 4);
+    for(uint t = 0; t < 100; t++) {
+        bout_step(a, NULL, obsA.data(), NULL, NULL);
+        bout_step(b, zeros.data(), obsB.data(), NULL, NULL);
+    }
+    cout << "no actions " << (obsA == obsB && obsA[BOUT_OBS_TICK] == 100?
+            "play as all 0" : "DON'T play as all 0") << endl;
+    bout_destroy(a);
+    bout_destroy(b);
+}
+#endif
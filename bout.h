@@ -0,0 +1,71 @@
+#pragma once
+#include <stdint.h>
+
+/* C interface to the simulation, to drive lots of games at once from
+ * some other program (agents being trained, for instance) without
+ * paying for a call per game per tick.
+ *
+ * A batch is a number of independent headless games of the stock
+ * level. bout_step() plays one tick of each of them and takes and
+ * fills flat arrays, a row per game:
+ *
+ *  actions  int8_t[games][2]    top bat, bottom bat: -1 moves it left,
+ *                               1 right, 0 leaves it. Top one is not
+ *                               read when a bot plays the top bat.
+ *  obs      int32_t[games][BOUT_OBS_SIZE], laid out as BOUT_OBS_*
+ *                               below say.
+ *  rewards  float[games][2]     top, bottom: 1 when the other one lost
+ *                               a ball in this tick, -1 when it did.
+ *  done     uint8_t[games]      1 when the game ended in this tick.
+ *
+ * A game that ended starts over at once, its obs is then the first
+ * tick of the new one. Games are split among config.threads threads,
+ * the caller's is one of them. All the games play the same way for
+ * the same seed and actions, whatever the machine and its standard
+ * library: bots' noise comes from mt19937 itself, not from the
+ * library's distributions. */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Observation of one game, offsets into its row.
+ *  TICK     ticks since the game started.
+ *  BATS     x, y of top bat, x, y of bottom bat.
+ *  CHANCES  balls top and bottom may still lose.
+ *  BALLS    x, y, dx, dy, visible of top's ball, then of bottom's.
+ *  BOXES    one for each of 64 boxes, 1 while it stands. */
+#define BOUT_OBS_TICK     0
+#define BOUT_OBS_BATS     1
+#define BOUT_OBS_CHANCES  5
+#define BOUT_OBS_BALLS    7
+#define BOUT_OBS_BOXES    17
+#define BOUT_OBS_SIZE     81
+
+typedef struct {
+    unsigned games;
+    unsigned seed;        /* game i plays with seed + i */
+    unsigned threads;     /* 0 is as 1, all in the caller's thread */
+    unsigned tickLimit;   /* game is a draw after that many, 0 never */
+    float    botSkill;    /* bot plays top bat with this skill, 0..1;
+                             negative leaves it to actions */
+} bout_config;
+
+typedef struct bout_batch bout_batch;
+
+/* NULL if the batch can't be made, also if config is NULL or has
+ * no games. */
+bout_batch *bout_create(const bout_config *config);
+void bout_destroy(bout_batch *batch);
+
+/* All the games start over. obs may be NULL. */
+void bout_reset(bout_batch *batch, int32_t *obs);
+
+/* One tick of every game. rewards and done may be NULL, so may be
+ * actions: then no bat moves, as if they were all 0. */
+void bout_step(bout_batch *batch, const int8_t *actions, int32_t *obs,
+               float *rewards, uint8_t *done);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,146 @@
+#include "canvas.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+void Canvas::fillCircle(int x, int y, int r) {
+    for(int dy = 1; dy < r; dy++) {
+        /* Draw circle line by line.
+         *
+         * Formula (for point 0,0) is: r^2 = x^2 + y^2
+         *
+         * now we have y and r known, so:
+         * x = +/- sqrt(r^2 - y^2)
+         *
+         * Of course we have to apply offset (x,y),
+         * so I operate on dx and dy rather than x & y.*/
+
+        int dx = floor(sqrt(r*r - dy*dy));
+        hline(x - dx, x + dx, y - dy);
+        hline(x - dx, x + dx, y + dy);
+    }
+
+    hline(x - r, x + r, y);
+}
+
+void SdlCanvas::color(uint8_t r, uint8_t g, uint8_t b) {
+    SDL_SetRenderDrawColor(renderer, r, g, b, SDL_ALPHA_OPAQUE);
+}
+
+void SdlCanvas::fillRect(int x, int y, int w, int h) {
+    SDL_Rect rect;
+    rect.x = x;
+    rect.y = y;
+    rect.w = w;
+    rect.h = h;
+
+    SDL_RenderFillRect(renderer, &rect);
+}
+
+void SdlCanvas::hline(int x0, int x1, int y) {
+    SDL_RenderDrawLine(renderer, x0, y, x1, y);
+}
+
+void SdlCanvas::clear() {
+    SDL_RenderClear(renderer);
+}
+
+void SdlCanvas::present() {
+    SDL_RenderPresent(renderer);
+}
+
+bool SdlCanvas::readPixels(void *dst, int w, int h, int pitch) {
+    int rw, rh;
+    if(SDL_GetRendererOutputSize(renderer, &rw, &rh) != 0
+       || rw != w || rh != h)
+        return false;
+
+    return SDL_RenderReadPixels(renderer, NULL, SDL_PIXELFORMAT_RGBA32,
+                                dst, pitch) == 0;
+}
+
+FrameBuffer::FrameBuffer(uint width, uint height)
+    : w(width), h(height), px(width * height, 0) {
+    color(0, 0, 0);
+}
+
+void FrameBuffer::color(uint8_t r, uint8_t g, uint8_t b) {
+    uint8_t bytes[4] = {r, g, b, SDL_ALPHA_OPAQUE};
+    memcpy(&ink, bytes, 4);
+}
+
+/* Fills n pixels starting at p. That's where all the time goes,
+ * so with SSE2 it writes 4 pixels per store. */
+void FrameBuffer::span(uint32_t *p, int n) {
+#ifdef __SSE2__
+    __m128i v = _mm_set1_epi32(ink);
+    for(; n >= 16; n -= 16, p += 16) {
+        _mm_storeu_si128((__m128i *) p, v);
+        _mm_storeu_si128((__m128i *) (p + 4), v);
+        _mm_storeu_si128((__m128i *) (p + 8), v);
+        _mm_storeu_si128((__m128i *) (p + 12), v);
+    }
+    for(; n >= 4; n -= 4, p += 4)
+        _mm_storeu_si128((__m128i *) p, v);
+#endif
+    for(; n > 0; n--)
+        *p++ = ink;
+}
+
+void FrameBuffer::fillRect(int x, int y, int rw, int rh) {
+    int x0 = max(x, 0), x1 = min(x + rw, (int) w),
+        y0 = max(y, 0), y1 = min(y + rh, (int) h);
+    if(x0 >= x1)
+        return;
+
+    for(int row = y0; row < y1; row++)
+        span(&px[row * w + x0], x1 - x0);
+}
+
+void FrameBuffer::hline(int x0, int x1, int y) {
+    if(x0 > x1)
+        swap(x0, x1);
+
+    fillRect(x0, y, x1 - x0 + 1, 1);
+}
+
+void FrameBuffer::clear() {
+    span(px.data(), px.size());
+}
+
+void FrameBuffer::present() {
+    presented++;
+}
+
+bool FrameBuffer::readPixels(void *dst, int width, int height, int pitch) {
+    if((uint) width != w || (uint) height != h)
+        return false;
+
+    for(uint y = 0; y < h; y++)
+        memcpy((char *) dst + y * pitch, &px[y * w], w * 4);
+
+    return true;
+}
+
+void writePPM(string path, const uint32_t *px, uint w, uint h) {
+    ofstream out(path.c_str(), ios::binary);
+    out << "P6\n" << w << " " << h << "\n255\n";
+
+    vector<char> row(w * 3);
+    for(uint y = 0; y < h; y++) {
+        for(uint x = 0; x < w; x++) {
+            const char *p = (const char *) &px[y * w + x];
+            row[3*x] = p[0];
+            row[3*x + 1] = p[1];
+            row[3*x + 2] = p[2];
+        }
+        out.write(row.data(), row.size());
+    }
+}
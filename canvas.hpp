@@ -0,0 +1,106 @@
+#pragma once
+#include <SDL.h>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+using namespace std;
+
+/* Canvas is what toys draw on. There are two of them:
+ *  SdlCanvas   draws with SDL_Renderer, in a window.
+ *  FrameBuffer rasterizes into plain RGBA memory, needs no display
+ *              at all. Good for rendering offscreen, as fast as
+ *              possible, and for comparing frames byte by byte.
+ *
+ *  color()      sets color for everything drawn next.
+ *  fillRect()   fills rectangle w x h with top left corner at x,y.
+ *  hline()      draws horizontal line from x0 to x1, both included.
+ *  fillCircle() filled circle, made of hline()s.
+ *  clear()      fills whole canvas with current color.
+ *  present()    frame is done, show it.
+ *  readPixels() copies current frame to dst as RGBA32, w x h pixels,
+ *               rows pitch bytes apart. Call it before present(), it
+ *               returns false if it can't or the frame isn't w x h.
+ */
+class Canvas {
+    public:
+    virtual ~Canvas() {}
+    virtual void color(uint8_t r, uint8_t g, uint8_t b) = 0;
+    virtual void fillRect(int x, int y, int w, int h) = 0;
+    virtual void hline(int x0, int x1, int y) = 0;
+    virtual void clear() = 0;
+    virtual void present() = 0;
+    virtual bool readPixels(void *dst, int w, int h, int pitch) = 0;
+
+    void fillCircle(int x, int y, int r);
+};
+
+/* Draws on another canvas, everything moved by dx, dy. That's how
+ * a window looks at part of a world bigger than itself. */
+class ShiftedCanvas : public Canvas {
+    public:
+    ShiftedCanvas(Canvas &canvas, int dx, int dy)
+        : canvas(canvas), dx(dx), dy(dy) {}
+
+    void color(uint8_t r, uint8_t g, uint8_t b) { canvas.color(r, g, b); }
+    void fillRect(int x, int y, int w, int h) {
+        canvas.fillRect(x + dx, y + dy, w, h);
+    }
+    void hline(int x0, int x1, int y) { canvas.hline(x0 + dx, x1 + dx, y + dy); }
+    void clear() { canvas.clear(); }
+    void present() { canvas.present(); }
+    bool readPixels(void *dst, int w, int h, int pitch) {
+        return canvas.readPixels(dst, w, h, pitch);
+    }
+
+    private:
+    Canvas &canvas;
+    int dx, dy;
+};
+
+// Writes RGBA32 picture as binary PPM, alpha is dropped.
+void writePPM(string path, const uint32_t *px, uint w, uint h);
+
+class SdlCanvas : public Canvas {
+    public:
+    SdlCanvas(SDL_Renderer *renderer): renderer(renderer) {}
+
+    void color(uint8_t r, uint8_t g, uint8_t b);
+    void fillRect(int x, int y, int w, int h);
+    void hline(int x0, int x1, int y);
+    void clear();
+    void present();
+    bool readPixels(void *dst, int w, int h, int pitch);
+
+    private:
+    SDL_Renderer *renderer;
+};
+
+/* Pixels are 4 bytes each: red, green, blue, alpha, in that order
+ * in memory (SDL_PIXELFORMAT_RGBA32), rows one after another. */
+class FrameBuffer : public Canvas {
+    public:
+    FrameBuffer(uint width, uint height);
+
+    void color(uint8_t r, uint8_t g, uint8_t b);
+    void fillRect(int x, int y, int w, int h);
+    void hline(int x0, int x1, int y);
+    void clear();
+    void present();
+    bool readPixels(void *dst, int w, int h, int pitch);
+
+    const uint32_t *pixels() const { return px.data(); }
+    uint width() const { return w; }
+    uint height() const { return h; }
+    unsigned long frames() const { return presented; }
+
+    void savePPM(string path) const { writePPM(path, px.data(), w, h); }
+
+    private:
+    void span(uint32_t *p, int n);
+
+    uint w, h;
+    vector<uint32_t> px;
+    uint32_t ink = 0;
+    unsigned long presented = 0;
+};
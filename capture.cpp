@@ -0,0 +1,197 @@
+#include "capture.hpp"
+#include <chrono>
+
+using namespace std;
+
+static void put32(vector<char> &out, uint32_t n) {
+    for(uint i = 0; i < 4; i++)
+        out.push_back((char)((n >> (8*i)) & 0xff));
+}
+
+static void put16(vector<char> &out, uint n) {
+    out.push_back((char)(n & 0xff));
+    out.push_back((char)((n >> 8) & 0xff));
+}
+
+static bool get(ifstream &in, uint32_t &n, uint bytes) {
+    unsigned char b[4];
+    if(!in.read((char *) b, bytes))
+        return false;
+
+    n = 0;
+    for(uint i = 0; i < bytes; i++)
+        n |= (uint32_t) b[i] << (8*i);
+
+    return true;
+}
+
+FrameRecorder::FrameRecorder(string path, uint width, uint height,
+                             uint buffers)
+        : w(width), h(height), file(path.c_str(), ios::binary),
+          pool(buffers, vector<uint32_t>(width * height)),
+          previous(width * height, 0) {
+    if(!file)
+        throw CaptureException("can't open " + path);
+
+    vector<char> header;
+    header.insert(header.end(), "BOUTREC1", "BOUTREC1" + 8);
+    put32(header, w);
+    put32(header, h);
+    if(!file.write(header.data(), header.size()))
+        throw CaptureException("can't write " + path);
+
+    for(uint i = 0; i < buffers; i++)
+        idle.push_back(i);
+
+    worker = thread(&FrameRecorder::writer, this);
+}
+
+FrameRecorder::~FrameRecorder() {
+    {
+        lock_guard<mutex> l(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+}
+
+bool FrameRecorder::capture(Canvas &canvas) {
+    uint b;
+    {
+        lock_guard<mutex> l(lock);
+        if(idle.empty() || counters.failed) {
+            counters.dropped++;
+            return false;
+        }
+        b = idle.front();
+        idle.pop_front();
+    }
+
+    bool ok = canvas.readPixels(pool[b].data(), w, h, w * 4);
+
+    {
+        lock_guard<mutex> l(lock);
+        if(ok) {
+            queued.push_back(b);
+            counters.captured++;
+        } else {
+            idle.push_back(b);
+            counters.dropped++;
+        }
+    }
+    if(ok)
+        wake.notify_one();
+
+    return ok;
+}
+
+RecorderStats FrameRecorder::stats() {
+    lock_guard<mutex> l(lock);
+    return counters;
+}
+
+void FrameRecorder::writer() {
+    vector<char> out;
+    unique_lock<mutex> l(lock);
+
+    while(true) {
+        wake.wait(l, [this]() { return stopping || !queued.empty(); });
+        if(queued.empty())
+            break;
+
+        uint b = queued.front();
+        queued.pop_front();
+        l.unlock();
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        out.clear();
+        put32(out, 0);
+        encode(pool[b].data(), out);
+        uint32_t size = out.size() - 4;
+        for(uint i = 0; i < 4; i++)
+            out[i] = (char)((size >> (8*i)) & 0xff);
+        bool ok = (bool) file.write(out.data(), out.size());
+        double secs = chrono::duration<double>(
+                chrono::steady_clock::now() - start).count();
+
+        l.lock();
+        idle.push_back(b);
+        if(!ok) {
+            counters.failed = true;
+            idle.insert(idle.end(), queued.begin(), queued.end());
+            queued.clear();
+            return;
+        }
+        counters.written++;
+        counters.rawBytes += w * h * 4;
+        counters.fileBytes += out.size();
+        counters.writerSeconds += secs;
+    }
+
+    if(!file.flush())
+        counters.failed = true;
+}
+
+void FrameRecorder::encode(const uint32_t *frame, vector<char> &out) {
+    uint n = w * h, i = 0;
+
+    while(i < n) {
+        uint zeros = 0;
+        while(i < n && zeros < 0xffff && frame[i] == previous[i]) {
+            zeros++;
+            i++;
+        }
+
+        uint start = i, literals = 0;
+        while(i < n && literals < 0xffff && frame[i] != previous[i]) {
+            literals++;
+            i++;
+        }
+
+        put16(out, zeros);
+        put16(out, literals);
+        for(uint j = start; j < i; j++) {
+            uint32_t x = frame[j] ^ previous[j];
+            out.insert(out.end(), (char *) &x, (char *) &x + 4);
+            previous[j] = frame[j];
+        }
+    }
+}
+
+RecordingReader::RecordingReader(string path)
+        : file(path.c_str(), ios::binary) {
+    char magic[8];
+    uint32_t width, height;
+    if(!file.read(magic, 8) || string(magic, 8) != "BOUTREC1"
+       || !get(file, width, 4) || !get(file, height, 4))
+        throw CaptureException(path + " is not a recording");
+
+    w = width;
+    h = height;
+    frame.assign(w * h, 0);
+}
+
+bool RecordingReader::next() {
+    uint32_t size;
+    if(!get(file, size, 4))
+        return false;
+
+    uint i = 0, n = w * h;
+    while(size >= 4 && i < n) {
+        uint32_t zeros, literals;
+        if(!get(file, zeros, 2) || !get(file, literals, 2))
+            throw CaptureException("recording is cut short");
+        size -= 4;
+        i += zeros;
+
+        for(uint j = 0; j < literals && i < n; j++, i++) {
+            uint32_t x;
+            if(!file.read((char *) &x, 4))
+                throw CaptureException("recording is cut short");
+            frame[i] ^= x;
+            size -= 4;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#include "canvas.hpp"
+
+using namespace std;
+
+struct CaptureException {
+    CaptureException(string msg): msg(msg) {}
+
+    string msg;
+};
+
+struct RecorderStats {
+    unsigned long captured = 0,   // frames handed to the writer
+                  dropped = 0,    // frames skipped, writer was behind
+                  written = 0;    // frames already in the file
+    unsigned long long rawBytes = 0, fileBytes = 0;
+    double writerSeconds = 0;     // time writer spent working
+    bool failed = false;          // file write failed, writer stopped
+
+    // Uncompressed megabytes per second the writer keeps up with.
+    double throughput() const {
+        return (writerSeconds > 0)? rawBytes / writerSeconds / 1e6 : 0;
+    }
+};
+
+/* Records frames to a file without holding up the game.
+ *
+ * capture() is called by playground just before a frame is presented.
+ * It takes one of preallocated buffers, copies the frame there and
+ * hands it to the writer thread. If all the buffers are still waiting
+ * to be written, the frame is dropped and counted; capture() never
+ * waits for the disk. A frame of other size than width x height is
+ * dropped as well, and so is every frame once writing to the file
+ * failed; stats() tell.
+ *
+ * File starts with "BOUTREC1", width and height (uint32 each), then
+ * frames follow: uint32 payload size and payload. Payload is the frame
+ * XOR-ed with the previous one (first frame with all zeros), cut into
+ * pairs of uint16 counts: zero pixels to skip, literal pixels that
+ * follow. Still parts of the screen cost next to nothing that way.
+ * All numbers are little endian. */
+class FrameRecorder {
+    public:
+    FrameRecorder(string path, uint width, uint height, uint buffers = 8);
+    ~FrameRecorder();
+
+    bool capture(Canvas &canvas);
+    RecorderStats stats();
+
+    private:
+    void writer();
+    void encode(const uint32_t *frame, vector<char> &out);
+
+    uint w, h;
+    ofstream file;
+    vector<vector<uint32_t> > pool;
+    vector<uint32_t> previous;
+    deque<uint> idle, queued;
+    bool stopping = false;
+    RecorderStats counters;
+
+    mutex lock;
+    condition_variable wake;
+    thread worker;
+};
+
+/* Reads frames back, one by one. next() returns false at the end. */
+class RecordingReader {
+    public:
+    RecordingReader(string path);
+
+    bool next();
+    const uint32_t *pixels() const { return frame.data(); }
+    uint width() const { return w; }
+    uint height() const { return h; }
+
+    private:
+    ifstream file;
+    uint w, h;
+    vector<uint32_t> frame;
+};
@@ -0,0 +1,459 @@
+#include "game.hpp"
+#include <cstdlib>
+#include <cmath>
+
+using namespace std;
+
+void fatal() {
+    fatal(SDL_GetError());
+}
+
+void fatal(string why) {
+    fprintf (stderr, "b-out: %s\n", why.c_str());
+    SDL_Quit();
+    exit(EXIT_FAILURE);
+}
+
+std::mt19937 &randomEngine() {
+    static thread_local std::mt19937 rng(std::random_device{}());
+    return rng;
+}
+
+// Straight from the engine, library's distributions differ.
+int random (uint min, uint max) {
+    return min + randomEngine()() % (max - min + 1);
+}
+
+Point stockBox(uint i) {
+    return Point(200+50*(i/8), 200+20*(i%8));
+}
+
+SeatPlace::SeatPlace(uint seat, uint players, coord width) {
+    bool bottom = (seat % 2 == 0);
+    uint lanes = bottom? (players + 1) / 2 : players / 2,
+         lane = seat / 2;
+
+    dir = bottom? Ball::up : Ball::down;
+    from = width * lane / lanes;
+    to = width * (lane + 1) / lanes;
+    bat = Point((from + to) / 2 - 50, bottom? 550 : 50);
+}
+
+Mov initialBallMovement(Ball::Direction direction) {
+    int dx = 3;
+    int dy = direction * (6 - abs(dx));
+    return Mov(dx, dy);
+}
+
+/* Playground's toy loops, defined here because they need the toy
+ * classes complete. */
+
+struct Playground::TickPhase {
+    Playground &pg;
+
+    template<class T>
+    void visit(vector<T*> &shelf) {
+        if(ToyKind<T>::ticks)
+            for(uint i = 0; i < shelf.size(); i++)
+                shelf[i]->timePassed(pg, 1);
+    }
+};
+
+struct Playground::DrawPhase {
+    Canvas &canvas;
+
+    template<class T>
+    void visit(vector<T*> &shelf) {
+        if(ToyKind<T>::draws)
+            for(T *t : shelf)
+                t->draw(canvas);
+    }
+};
+
+/* Looks for the closest segment near the route, remembers which
+ * toy it belongs to and how to notify it. With still false it looks
+ * only at toys that move, with measure it remembers how close to the
+ * route's end the nearest of those that don't is. */
+struct Playground::HitScan {
+    HitScan(Segment route, uint r, bool still = true, bool measure = false)
+        : route(route), r(r), still(still), measure(measure) {}
+
+    template<class T>
+    void visit(vector<T*> &shelf) {
+        if(!still && !ToyKind<T>::moves)
+            return;
+
+        for(uint i = 0; i < shelf.size(); i++)
+            for(Segment &s : shelf[i]->boundaries()) {
+                check(s, &Playground::hit<T>, i);
+                if(measure && !ToyKind<T>::moves)
+                    nearest2 = min(nearest2, s.approxDist2(route.b));
+            }
+    }
+
+    void check(Segment &s, void (Playground::*onHit)(uint), uint i) {
+        optional<Point> p = s.closePoint(route, r);
+        if(p && (!intersection
+                 || intersection->dist2(route.a) > p->dist2(route.a))) {
+            intersection = p;
+            is = &s;
+            hit = onHit;
+            index = i;
+        }
+    }
+
+    Segment route;
+    uint r;
+    bool still, measure;
+    double nearest2 = 1e30;
+    optional<Point> intersection;
+    Segment *is = NULL;
+    void (Playground::*hit)(uint) = NULL;
+    uint index = 0;
+};
+
+template<class T>
+void Playground::hit(uint index) {
+    vector<T*> &shelf = toys.of<T>();
+    T *toy = shelf[index];
+
+    toy->collision();
+    if(ToyKind<T>::breaks && toy->destroyed())
+        shelf.erase(shelf.begin() + index);
+}
+
+void Playground::tick() {
+    running = true;
+    {
+        AllocScope scope(alloc::net);
+        for(Player *p : players)
+            if(p->wantsUpdates()) {
+                Player *other = opponentOf(p);
+                p->setPos(p->timePassed(other? other->getPos() : p->getPos()));
+            }
+    }
+
+    step();
+
+    if(spectators) {
+        AllocScope scope(alloc::net);
+        spectators->broadcast(state());
+    }
+}
+
+void Playground::step() {
+    AllocScope scope(alloc::physics);
+    TickPhase phase = {*this};
+    toys.each(phase);
+}
+
+void Playground::save(Snapshot &s) {
+    s.balls.clear();
+    for(Ball *b : toys.of<Ball>())
+        s.balls.push_back(b->state());
+
+    s.bats.clear();
+    for(Bat *b : toys.of<Bat>())
+        s.bats.push_back(b->state());
+
+    s.boxes.clear();
+    for(Box *b : level)
+        s.boxes.push_back(b->state());
+
+    s.pilots.clear();
+    for(Autopilot *a : toys.of<Autopilot>())
+        s.pilots.push_back(a->state());
+
+    s.chances.clear();
+    for(Player *p : players)
+        s.chances.push_back(p->chancesLeft());
+}
+
+void Playground::wake() {
+    for(Ball *b : toys.of<Ball>())
+        b->wake();
+}
+
+void Playground::restore(const Snapshot &s) {
+    vector<Ball*> &balls = toys.of<Ball>();
+    for(uint i = 0; i < balls.size(); i++)
+        balls[i]->restore(s.balls[i]);
+
+    vector<Bat*> &bats = toys.of<Bat>();
+    for(uint i = 0; i < bats.size(); i++)
+        bats[i]->restore(s.bats[i]);
+
+    // broken boxes come back, in the order they were added
+    vector<Box*> &boxes = toys.of<Box>();
+    boxes.clear();
+    for(uint i = 0; i < level.size(); i++) {
+        level[i]->restore(s.boxes[i]);
+        if(!level[i]->destroyed())
+            boxes.push_back(level[i]);
+    }
+
+    vector<Autopilot*> &pilots = toys.of<Autopilot>();
+    for(uint i = 0; i < pilots.size(); i++)
+        pilots[i]->restore(s.pilots[i]);
+
+    uint i = 0;
+    for(Player *p : players)
+        p->setChances(s.chances[i++]);
+}
+
+string Playground::state() {
+    string st;
+    char buf[4];
+
+    vector<Point> balls, bats;
+    for(Ball *b : toys.of<Ball>())
+        if(b->isVisible())
+            balls.push_back(b->getPos());
+    for(Bat *b : toys.of<Bat>())
+        if(b->isVisible())
+            bats.push_back(b->getPos());
+
+    for(vector<Point> *points : {&balls, &bats}) {
+        write16(buf, points->size());
+        st.append(buf, 2);
+        for(Point &p : *points)
+            st += p.bin();
+    }
+
+    write16(buf, level.size());
+    st.append(buf, 2);
+    string bits((level.size() + 7) / 8, '\0');
+    for(uint i = 0; i < level.size(); i++)
+        if(!level[i]->destroyed())
+            bits[i / 8] |= 1 << (i % 8);
+
+    return st + bits;
+}
+
+void Playground::drawToys() {
+    if(!canvas)
+        return;
+
+    AllocScope scope(alloc::render);
+    if(corner.x == 0 && corner.y == 0) {
+        DrawPhase phase = {*canvas};
+        toys.each(phase);
+    } else {
+        ShiftedCanvas view(*canvas, -corner.x, -corner.y);
+        DrawPhase phase = {view};
+        toys.each(phase);
+    }
+}
+
+Collision Playground::obstacle(Segment route, uint r, uint *free) {
+    bool kinetic = kineticMode && free,
+         still = !kinetic || *free == 0;
+    HitScan scan(route, r, still, kinetic);
+
+    if(still)
+        for(Segment &s : boundaries) {
+            scan.check(s, NULL, 0);
+            if(kinetic)
+                scan.nearest2 = min(scan.nearest2, s.approxDist2(route.b));
+        }
+
+    toys.each(scan);
+
+    if (scan.hit)
+        (this->*scan.hit)(scan.index);
+
+    if(kinetic) {
+        if(scan.intersection)
+            *free = 0;
+        else if(!still)
+            (*free)--;
+        else {
+            /* Route's end goes at most speed further each tick, it
+             * comes near a segment only once it's less than r + 1
+             * away. A bit is taken off for rounding. */
+            double dx = route.b.x - route.a.x, dy = route.b.y - route.a.y,
+                   speed = sqrt(dx * dx + dy * dy),
+                   room = sqrt(scan.nearest2) - (r + 1) - 1e-6;
+            *free = (speed == 0)? 1u << 30
+                  : (uint) max(0.0, min(room / speed, (double)(1u << 30)));
+        }
+    }
+
+    if(scan.intersection) {
+        Segment *is = scan.is;
+        return Collision(
+                *scan.intersection,
+                (is->a.x == is->b.x)?
+                    Mov(route.a.x - route.b.x,
+                        route.b.y - route.a.y)
+                    :Mov(route.b.x - route.a.x,
+                        route.a.y - route.b.y)
+        );
+    }
+
+    return Collision();
+}
+
+const uint Rollback::none, Rollback::maxAhead, Rollback::showDelay;
+const coord Rollback::maxCorrection;
+const uint RelayPlayer::history, RelayPlayer::catchUp;
+
+StreamedLevel::~StreamedLevel() {
+    for(auto &c : resident)
+        for(Box *b : c.second)
+            delete b;
+    for(Box *b : spare)
+        delete b;
+}
+
+StreamedLevel::Area StreamedLevel::around(Point a, Point b) {
+    int size = loader.level().chunkSize();
+
+    return Area{a.x / size, a.y / size, b.x / size, b.y / size};
+}
+
+// True if chunk is at most distance chunks off any of the areas.
+bool StreamedLevel::near(uint chunk, int distance) {
+    int cols = loader.level().cols(),
+        col = chunk % cols, row = chunk / cols;
+
+    for(Area &a : areas)
+        if(col >= a.col0 - distance && col <= a.col1 + distance
+           && row >= a.row0 - distance && row <= a.row1 + distance)
+            return true;
+
+    return false;
+}
+
+void StreamedLevel::timePassed(Playground &pg, uint dt) {
+    AllocScope scope(alloc::level);
+    const LevelFile &level = loader.level();
+    int cols = level.cols(), rows = level.rows();
+
+    if(followed)
+        pg.lookAt(followed->getPos());
+
+    Point corner = pg.viewCorner();
+    Mov size = pg.viewSize();
+    areas.clear();
+    areas.push_back(around(corner, Point(corner.x + size.dx - 1,
+                                         corner.y + size.dy - 1)));
+    for(Ball *b : pg.balls())
+        if(b->isVisible())
+            areas.push_back(around(b->getPos(), b->getPos()));
+
+    // where balls are, boxes must be there this very tick
+    for(uint i = 1; i < areas.size(); i++) {
+        Area &a = areas[i];
+        for(int row = max(a.row0 - 1, 0); row <= min(a.row1 + 1, rows - 1); row++)
+            for(int col = max(a.col0 - 1, 0); col <= min(a.col1 + 1, cols - 1); col++) {
+                uint chunk = row * cols + col;
+                if(resident.count(chunk))
+                    continue;
+
+                loader.readNow(chunk, read);
+                add(pg, chunk, read);
+                counters.waited++;
+            }
+    }
+
+    uint chunk;
+    while(loader.take(chunk, read)) {
+        asked.erase(chunk);
+        if(!resident.count(chunk) && near(chunk, margin + 1))
+            add(pg, chunk, read);
+    }
+
+    for(Area &a : areas)
+        for(int row = max(a.row0 - margin, 0); row <= min(a.row1 + margin, rows - 1); row++)
+            for(int col = max(a.col0 - margin, 0); col <= min(a.col1 + margin, cols - 1); col++) {
+                chunk = row * cols + col;
+                if(!resident.count(chunk) && asked.insert(chunk).second)
+                    loader.want(chunk);
+            }
+
+    leaving.clear();
+    for(auto &c : resident)
+        if(!near(c.first, margin + 1))
+            leaving.push_back(c.first);
+    for(uint c : leaving)
+        remove(pg, c);
+
+    for(auto i = asked.begin(); i != asked.end(); )
+        if(!near(*i, margin + 1)) {
+            loader.forget(*i);
+            i = asked.erase(i);
+        } else
+            i++;
+}
+
+void StreamedLevel::fill(Playground &pg) {
+    AllocScope scope(alloc::level);
+    unsigned long waited = counters.waited;
+    timePassed(pg, 0);
+    counters.waited = waited;
+
+    for(uint chunk : asked) {
+        loader.readNow(chunk, read);
+        add(pg, chunk, read);
+    }
+    // those already asked for come again, they're dropped then
+    asked.clear();
+}
+
+void StreamedLevel::add(Playground &pg, uint chunk,
+                        const vector<LevelBox> &boxes) {
+    auto worn = hits.find(chunk);
+    vector<Box*> &in = resident[chunk];
+
+    for(uint i = 0; i < boxes.size(); i++) {
+        const LevelBox &l = boxes[i];
+        Box *b;
+        if(spare.empty())
+            b = new Box();
+        else {
+            b = spare.back();
+            spare.pop_back();
+        }
+
+        uint took = (worn == hits.end())? 0 : worn->second[i];
+        b->at(Point(l.x, l.y)).restore(Box::State{took, l.r, l.g, l.b});
+        in.push_back(b);
+        if(!b->destroyed())
+            pg.with(*b);
+    }
+
+    vector<Box*> &shelf = pg.boxes();
+    shelf.clear();
+    for(auto &c : resident)
+        for(Box *b : c.second)
+            if(!b->destroyed())
+                shelf.push_back(b);
+
+    counters.chunks++;
+    counters.boxes += in.size();
+    counters.peakBoxes = max(counters.peakBoxes, counters.boxes);
+    counters.loaded++;
+}
+
+void StreamedLevel::remove(Playground &pg, uint chunk) {
+    vector<Box*> &out = resident[chunk];
+
+    for(uint i = 0; i < out.size(); i++) {
+        Box *b = out[i];
+        uint took = b->state().hits;
+        if(took) {
+            vector<uint8_t> &worn = hits[chunk];
+            worn.resize(out.size());
+            worn[i] = min(took, 255u);
+        }
+
+        pg.without(*b);
+        spare.push_back(b);
+    }
+
+    counters.chunks--;
+    counters.boxes -= out.size();
+    counters.unloaded++;
+    resident.erase(chunk);
+}
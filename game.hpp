@@ -0,0 +1,1561 @@
+#pragma once
+#include <SDL.h>
+#include <vector>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <random>
+#include <iostream>
+
+#include "net.hpp"
+#include "geometry.hpp"
+#include "canvas.hpp"
+#include "capture.hpp"
+#include "level.hpp"
+#include "alloc.hpp"
+
+using namespace std;
+
+// Prints SDL's error, or why, and exits.
+void fatal();
+void fatal(string why);
+
+// Each thread has its own, seed it to make a game repeatable.
+std::mt19937 &randomEngine();
+int random(uint min, uint max);
+
+/* Game mechanics.
+ * Playground is a central class, it defines comminication
+ * with graphics API, it coordinates all elements of the
+ * game. Playground.play() function contains program's
+ * main event loop. */
+
+class Playground;
+
+
+/* Toy is an interface for all things displayed on the screen.
+ *  draw() function called by playground to draw object on the
+ *         canvas.
+ *
+ *  timePassed() function called by playground to notify object
+ *               that it should update its state. For example,
+ *               apply its movement. dt means how much time
+ *               passed, usually 1 unit.
+ *
+ *  collision() function called by playground to notify that
+ *              there was collision with it. Currently collision()
+ *              may happen only with a ball and ball is not notified,
+ *              because it asks playground if it can move to given
+ *              point, so that it knows.
+ *
+ *  destroyed() function called by playground to ask if object should
+ *              be removed. Usually a box after certain number of
+ *              collisions.
+ *
+ *  boundaries() function called by playground to get segments that
+ *               represent object boundaries to be used in collision
+ *               detection.
+ */
+class Toy {
+    public:
+    virtual void draw(Canvas &canvas) = 0;
+    virtual void timePassed(Playground &pg, uint dt) = 0;
+    virtual ~Toy() {}
+    virtual void collision() {}
+    virtual bool destroyed() {return false;}
+
+    vector<Segment> &boundaries() {
+        return bounds;
+    }
+
+    protected:
+    vector<Segment> bounds;
+};
+
+struct Collision {
+    public:
+    Collision(){}
+
+    Collision(Point where, Mov continuation)
+        : really(true), where(where), continuation(continuation) {}
+
+    bool really = false;
+    Point where = Point(0,0);
+    Mov continuation = Mov(0,0);
+};
+
+class KeyListener {
+    public:
+    virtual void keyPress(int action) = 0;
+};
+
+struct KeyBinding {
+    KeyBinding(){}
+    KeyBinding(KeyListener *listener, int actionId)
+        : listener(listener), action(actionId) {}
+
+    void trigger() {
+        listener->keyPress(action);
+    }
+
+    KeyListener *listener;
+    int         action;
+};
+
+// What playground tells players about, see Player::gameEvent().
+enum GameEvent {
+    gamePaused, gameResumed, gameQuit
+};
+
+/* Interface that represents a player.
+ * It's common for local and remote players. It's
+ * responsible to place bat and a ball in the playground.
+ * It also handles network communication if applicable.
+ *  initPlayer() called by playground asking to add objects
+ *               to it.
+ *  timePassed() called by playground each iteration of main
+ *               loop. It passes position of opponents bat and
+ *               asks position of this player's bat. It is an
+ *               interface for network communication. It is
+ *               called only if wantsUpdates() returns true.
+ *  defeated()  tells if the player has lost the game.
+ *  chancesLeft() balls the player may still lose, setChances()
+ *               puts it back when a snapshot is restored.
+ *  poll()       called by playground every iteration, paused
+ *               or not. Remote players connect and read the
+ *               other side's control messages there.
+ *  ready()      false while the player can't play yet, game
+ *               doesn't go on until all players are ready.
+ *  gameEvent()  playground tells what happened. Remote players
+ *               tell it to the other side.
+ */
+class Player {
+    public:
+    virtual ~Player() {};
+    virtual void initPlayer(Playground &pg) = 0;
+    virtual Point timePassed(Point other) = 0;
+    virtual bool wantsUpdates() {return false;}
+    virtual Point getPos() = 0;
+    virtual void setPos(Point pos) = 0;
+    virtual void loose() = 0;
+    virtual bool defeated() {return false;}
+    virtual int chancesLeft() = 0;
+    virtual void setChances(int n) = 0;
+    virtual void poll() {}
+    virtual bool ready() {return true;}
+    virtual void gameEvent(GameEvent e) {}
+};
+
+// Exception thrown when trying to add more than maxPlayers.
+struct TooManyPlayers {};
+
+class Ball;
+class Box;
+class Bat;
+class Goal;
+class Autopilot;
+
+/* Stock toys are known at compile time, so the playground keeps
+ * each kind in its own list and loops over them with plain,
+ * non-virtual calls. ToyKind tells which list a toy goes to and
+ * which phases do anything for it at all:
+ *  ticks  - timePassed() is not empty,
+ *  draws  - draw() is not empty,
+ *  breaks - destroyed() may ever return true,
+ *  moves  - its boundaries may move once it's in the playground.
+ * Anything else derived from Toy lands in the Toy list and goes
+ * through virtual calls like it always did. */
+template<class T>
+struct ToyKind {
+    typedef Toy shelf;
+    static const bool ticks = true, draws = true, breaks = true,
+                      moves = true;
+};
+
+template<> struct ToyKind<Ball> {
+    typedef Ball shelf;
+    static const bool ticks = true, draws = true, breaks = false,
+                      moves = false;
+};
+
+template<> struct ToyKind<Box> {
+    typedef Box shelf;
+    static const bool ticks = false, draws = true, breaks = true,
+                      moves = false;
+};
+
+template<> struct ToyKind<Bat> {
+    typedef Bat shelf;
+    static const bool ticks = false, draws = true, breaks = false,
+                      moves = true;
+};
+
+template<> struct ToyKind<Goal> {
+    typedef Goal shelf;
+    static const bool ticks = false, draws = false, breaks = false,
+                      moves = false;
+};
+
+template<> struct ToyKind<Autopilot> {
+    typedef Autopilot shelf;
+    static const bool ticks = true, draws = false, breaks = false,
+                      moves = false;
+};
+
+template<class T>
+struct Shelf {
+    vector<T*> items;
+};
+
+template<class... Ts>
+struct ToyShelves : Shelf<Ts>... {
+    template<class T>
+    vector<T*> &of() { return Shelf<T>::items; }
+
+    /* Calls phase.visit<T>(list of Ts) for every kind, in order
+     * of the template arguments. */
+    template<class Phase>
+    void each(Phase &phase) {
+        int pass[] = {0, (phase.visit(of<Ts>()), 0)...};
+        (void) pass;
+    }
+};
+
+/* How playground shows the game:
+ *  windowed - SDL window, needs a display.
+ *  software - rasterized into memory, see frame().
+ *  headless - not drawn at all, simulation only. */
+enum Backend {
+    windowed, software, headless
+};
+
+class Playground {
+    public:
+    Playground(uint width, uint height, Backend backend = windowed)
+            :w(width), h(height), viewW(width), viewH(height) {
+
+        if(backend == windowed) {
+            if(SDL_Init(SDL_INIT_VIDEO) < 0) fatal();
+
+            if(SDL_CreateWindowAndRenderer(
+                width, height, 0, &window, &renderer
+            ) != 0) fatal();
+
+            canvas = new SdlCanvas(renderer);
+        } else if(backend == software)
+            canvas = framebuffer = new FrameBuffer(width, height);
+
+        if(canvas) {
+            newFrame();
+            show();
+        }
+
+        walls();
+    }
+
+    ~Playground() {
+        for(Player *p : players)
+            delete p;
+
+        delete canvas;
+        if(renderer) {
+            SDL_DestroyRenderer(renderer);
+            SDL_DestroyWindow(window);
+            SDL_Quit();
+        }
+    }
+
+    template<class T>
+    typename enable_if<is_base_of<Toy, T>::value, Playground&>::type
+    with(T &d) {
+        typedef typename ToyKind<T>::shelf S;
+        toys.of<S>().push_back(&d);
+        remember(&d);
+        wake();
+        // level is shown as it's being built, not once the game goes
+        if(canvas && !running) {
+            d.draw(*canvas);
+            canvas->present();
+        }
+
+        return *this;
+    }
+
+    // Toy leaves the playground, it may be gone already.
+    template<class T>
+    typename enable_if<is_base_of<Toy, T>::value, Playground&>::type
+    without(T &d) {
+        typedef typename ToyKind<T>::shelf S;
+        vector<S*> &shelf = toys.of<S>();
+        auto i = find(shelf.begin(), shelf.end(), &d);
+        if(i != shelf.end())
+            shelf.erase(i);
+        forget(&d);
+
+        return *this;
+    }
+
+    Playground& with(optional<Player*> player) {
+        if(player) {
+            if(players.size() == maxPlayers)
+                throw TooManyPlayers();
+            
+            (*player)->initPlayer(*this);
+            players.push_back(*player);
+        }
+
+        return *this;
+    }
+
+    template<class T>
+    Playground& with(vector<T*> toys) {
+        for(T* t: toys)
+            with(*t);
+
+        return *this;
+    }
+
+    void ballInAGoal(Player *p) {
+        p->loose();
+    }
+
+    void notify(GameEvent e) {
+        for(Player *p : players)
+            p->gameEvent(e);
+    }
+
+    /* Pause and quit, same as the keys, except that players are
+     * not told. That's for when the other side says so. */
+    void pause(bool on) { paused = on; }
+    void quit() { done = true; }
+
+    bool ready() {
+        for(Player *p : players)
+            if(!p->ready())
+                return false;
+
+        return true;
+    }
+
+    // First of the other players, NULL if there is none.
+    Player *opponentOf(Player *p) {
+        for(Player *o : players)
+            if(o != p)
+                return o;
+
+        return NULL;
+    }
+
+    // True once any of the players is defeated.
+    bool over() {
+        for(Player *p : players)
+            if(p->defeated())
+                return true;
+
+        return false;
+    }
+
+    /* World bigger than the window, which shows just part of it,
+     * see lookAt(). Goals span the world, so players come after. */
+    Playground& world(uint width, uint height) {
+        w = width;
+        h = height;
+        walls();
+        wake();
+
+        return *this;
+    }
+
+    uint width() { return w; }
+    uint height() { return h; }
+
+    // Window is moved so that p is in its middle, as far as it goes.
+    void lookAt(Point p) {
+        corner.x = max(0, min(p.x - (coord) viewW / 2, (coord) w - (coord) viewW));
+        corner.y = max(0, min(p.y - (coord) viewH / 2, (coord) h - (coord) viewH));
+    }
+
+    // Part of the world in the window.
+    Point viewCorner() { return corner; }
+    Mov viewSize() { return Mov(viewW, viewH); }
+
+    static const uint maxPlayers = 8;
+
+    vector<Ball*> &balls() { return toys.of<Ball>(); }
+    vector<Box*> &boxes() { return toys.of<Box>(); }
+
+    void play() {
+        uint last_time = SDL_GetTicks(), frames = 0;
+        alloc::frame();
+        while(!done) {
+            SDL_Event e;
+            while(SDL_PollEvent(&e) != 0) {
+                if(e.type == SDL_KEYDOWN) {
+                    auto b = keyBindings.find(e.key.keysym.sym);
+                    if (b != keyBindings.end())
+                        downKeys[b->first] = b->second;
+                    else if (e.key.keysym.sym == SDLK_q) {
+                        done = true;
+                        notify(gameQuit);
+                    } else if (e.key.keysym.sym == SDLK_ESCAPE) {
+                        paused = !paused;
+                        notify(paused? gamePaused : gameResumed);
+                    }
+                }
+
+                if(e.type == SDL_KEYUP) {
+                    auto b = downKeys.find(e.key.keysym.sym);
+                    if (b != downKeys.end()) {
+                        downKeys.erase(b);
+                    }
+                }
+            }
+
+            for(auto i = downKeys.begin(); i != downKeys.end(); i++) {
+                i->second.trigger();
+            }
+
+            {
+                AllocScope scope(alloc::net);
+                for(Player *p : players)
+                    p->poll();
+            }
+
+            // level is shown while waiting for the other player
+            if (!paused) {
+                newFrame();
+                if(ready())
+                    tick();
+                drawToys();
+            }
+            show();
+
+            if(alloc::enabled() && ++frames == 60) {
+                alloc::reportFrame(cerr, alloc::frame(), frames);
+                frames = 0;
+            }
+
+            while(SDL_GetTicks() < last_time + 17); // aim at 60fps
+            last_time = SDL_GetTicks();
+        }
+    }
+
+    /* Moves the game one step forward: exchanges bat positions
+     * with remote players if there are any and lets toys move. */
+    void tick();
+
+    // Just lets toys move, bats stay where they were put.
+    void step();
+
+    /* Everything that changes while stock toys play: balls, bats,
+     * boxes of the level (also those already broken), autopilots'
+     * random engines and aim, and players' chances. Kept in flat
+     * arrays, a snapshot reused for save() allocates nothing once
+     * it has been filled. Toys registered as plain Toy are not in
+     * it. */
+    struct Snapshot;
+    void save(Snapshot &s);
+    void restore(const Snapshot &s);
+
+    /* Collision detecting function. Route is a vector that represents
+     * movement would happend during current portion of time. r represents
+     * radious of the calling object.
+     *
+     * In kinetic mode free is how many ticks more the caller, going
+     * straight on, surely won't touch anything that doesn't move; that
+     * is boxes, goals and walls. Those are looked at only once it runs
+     * out, bats every time. When nothing is hit then, free is worked
+     * out anew from the distance to the closest of them: no route can
+     * end near a segment before it has gone that far. A hit sets it to
+     * zero, as the caller turns. Game goes exactly as it does with
+     * everything looked at every tick. */
+    Collision obstacle(Segment route, uint r, uint *free = NULL);
+
+    /* Kinetic mode, see obstacle(). Anything that doesn't move coming
+     * into the playground, or balls put elsewhere, make all the balls
+     * look around again. Toys going away don't, a route gets only
+     * freer by that. */
+    Playground& kinetic(bool on = true) {
+        kineticMode = on;
+        wake();
+
+        return *this;
+    }
+
+    Playground& withKey(int keysym, KeyBinding binding) {
+        keyBindings[keysym] = binding;
+
+        return *this;
+    }
+
+    // Draws current state of the game and shows it.
+    void render() {
+        newFrame();
+        drawToys();
+        show();
+    }
+
+    // Picture of the game if it runs on software backend, NULL otherwise.
+    FrameBuffer *frame() { return framebuffer; }
+
+    /* Each tick's state() goes to spectators from now on,
+     * NULL stops it. */
+    Playground& spectatedBy(SpectatorHub *hub) {
+        spectators = hub;
+
+        return *this;
+    }
+
+    /* Compact picture of the game for spectators: visible balls and
+     * bats as 16-bit x,y pairs, then one bit per box of the level,
+     * set while the box stands. Each part starts with 16-bit count,
+     * all little endian. */
+    string state();
+
+    /* Every frame shown from now on goes to the recorder too,
+     * NULL stops recording. */
+    Playground& recordTo(FrameRecorder *rec) {
+        recorder = rec;
+
+        return *this;
+    }
+
+    protected:
+    void newFrame() {
+        if(canvas) {
+            canvas->color(0, 0, 0);
+            canvas->clear();
+        }
+    }
+
+    void show() {
+        AllocScope scope(alloc::render);
+        if(canvas) {
+            if(recorder)
+                recorder->capture(*canvas);
+            canvas->present();
+        }
+    }
+
+    void drawToys();
+
+    private:
+    struct TickPhase;
+    struct DrawPhase;
+    struct HitScan;
+
+    template<class T>
+    void hit(uint index);
+
+    // Boxes are kept in order they came, to tell them apart in state().
+    void remember(Box *b) { level.push_back(b); }
+    void remember(Toy *t) {}
+    void forget(Box *b) {
+        auto i = find(level.begin(), level.end(), b);
+        if(i != level.end())
+            level.erase(i);
+    }
+    void forget(Toy *t) {}
+
+    void wake();
+
+    void walls() {
+        Point a = Point(0, 0),
+              b = Point(w, 0),
+              c = Point(w, h),
+              d = Point(0, h);
+
+        boundaries.clear();
+        boundaries.push_back(Segment(a, b));
+        boundaries.push_back(Segment(b, c));
+        boundaries.push_back(Segment(c, d));
+        boundaries.push_back(Segment(d, a));
+    }
+
+    uint w, h, viewW, viewH;
+    Point corner = Point(0, 0);
+    SDL_Window *window = NULL;
+    SDL_Renderer *renderer = NULL;
+    Canvas *canvas = NULL;
+    FrameBuffer *framebuffer = NULL;
+    FrameRecorder *recorder = NULL;
+    SpectatorHub *spectators = NULL;
+    vector<Box*> level;
+    bool done = false, paused = false, running = false, kineticMode = false;
+
+    list<Player*> players;
+    map<int,KeyBinding> downKeys;
+    map<int,KeyBinding> keyBindings;
+    vector<Segment> boundaries;
+    ToyShelves<Box, Bat, Goal, Autopilot, Ball, Toy> toys;
+};
+
+class Ball final : public Toy {
+    public:
+
+    void draw(Canvas &canvas) {
+        if(visible) {
+            canvas.color(red, green, blue);
+            canvas.fillCircle(pos.x, pos.y, r);
+        }
+    }
+    
+    void timePassed(Playground &pg, uint dt) {
+        if(visible) {
+            Point dest = velocity.apply(pos);
+
+            Collision c = pg.obstacle(Segment(pos, dest), r, &free);
+            if(!c.really) {
+                pos = dest;
+            } else {
+                pos = c.continuation.apply(c.where);
+                velocity = c.continuation;
+            }
+        }
+    }
+
+    Ball& at(Point p) {
+        pos = p;
+        free = 0;
+
+        return *this;
+    }
+
+    Ball& moving(Mov m) {
+        velocity = m;
+        free = 0;
+
+        return *this;
+    }
+
+    // Ball looks around next tick, see Playground::obstacle().
+    void wake() { free = 0; }
+
+    void hide() {
+        visible = false;
+        moving(Mov(0,0));
+    }
+
+    Point getPos() { return pos; }
+    Mov getVelocity() { return velocity; }
+    uint radius() { return r; }
+    bool isVisible() { return visible; }
+
+    enum Direction {
+        up = -1, down = 1
+    };
+
+    // All that changes while the game goes, for Playground::Snapshot.
+    struct State {
+        Point pos;
+        Mov velocity;
+        bool visible;
+    };
+
+    State state() const { return State{pos, velocity, visible}; }
+    void restore(const State &s) {
+        pos = s.pos;
+        velocity = s.velocity;
+        visible = s.visible;
+        free = 0;
+    }
+
+    private:
+    uint    red = 0xff, green = 0xff, blue=0, r=10;
+    Point   pos = Point(400,300);
+    Mov     velocity = Mov(0,0);
+    bool    visible = true;
+    uint    free = 0;       // ticks surely clear of still things
+};
+
+class Box final : public Toy {
+    public:
+    Box() {
+        r = random(10,255);
+        g = random(10,255);
+        b = random(10,255);
+
+        refresh();
+    }
+
+    ~Box(){}
+
+    Box &at(Point p) {
+        pos = p;
+        refresh();
+
+        return *this;
+    }
+
+    Box &painted(uint red, uint green, uint blue) {
+        r = red;
+        g = green;
+        b = blue;
+
+        return *this;
+    }
+
+    void draw(Canvas &canvas) {
+        canvas.color(r, g, b);
+        canvas.fillRect(pos.x, pos.y, w, h);
+    }
+
+    void collision() {
+        hits++;
+        r = random(10,255);
+        g = random(10,255);
+        b = random(10,255);
+    }
+
+    bool destroyed() { return hits >= 2; }
+    
+    void timePassed(Playground &pg, uint dt) {
+    }
+
+    struct State {
+        uint hits, r, g, b;
+    };
+
+    State state() const { return State{hits, r, g, b}; }
+    void restore(const State &s) {
+        hits = s.hits;
+        r = s.r;
+        g = s.g;
+        b = s.b;
+    }
+
+    private:
+    
+    void refresh() {
+        bounds.clear();
+        Point a(pos.x,      pos.y),
+              b(pos.x + w,  pos.y),
+              c(pos.x + w,  pos.y + h),
+              d(pos.x,      pos.y + h);
+
+        bounds.push_back(Segment(a, b));
+        bounds.push_back(Segment(b, c));
+        bounds.push_back(Segment(c, d));
+        bounds.push_back(Segment(d, a));
+    }
+
+    Point   pos = Point(0,0);
+    uint    w = 50, h = 20;
+    uint    r, g, b;
+    uint    hits = 0;
+};
+
+// Where i-th box of the stock 8x8 level goes.
+Point stockBox(uint i);
+
+class Bat final : public Toy, public KeyListener {
+    public:
+    Bat() {
+        refresh();
+    }
+
+    ~Bat() {}
+
+    void timePassed(Playground &pg, uint dt) {}
+    void draw(Canvas &canvas) {
+        if(visible) {
+            canvas.color(r, g, b);
+            canvas.fillRect(shown? *shown : pos.x, pos.y, w, h);
+        }
+    }
+
+    Bat &at(Point p) {
+        pos = p;
+        refresh();
+
+        return *this;
+    }
+
+    void refresh() {
+        bounds.clear();
+        // hidden bat is moved still, but nothing bounces off it
+        if(!visible)
+            return;
+
+        Point a(pos.x,      pos.y),
+              b(pos.x + w,  pos.y),
+              c(pos.x + w,  pos.y + h),
+              d(pos.x,      pos.y + h);
+
+        bounds.push_back(Segment(a, b));
+        bounds.push_back(Segment(b, c));
+        bounds.push_back(Segment(c, d));
+        bounds.push_back(Segment(d, a));
+    }
+
+    void keyPress(int action) {
+        switch(action) {
+            case moveLeft:
+                pos.x -= 7;
+                break;
+            case moveRight:
+                pos.x += 7;
+        }
+
+        refresh();
+    }
+
+    void hide() {
+        bounds.clear();
+        visible = false;
+    }
+
+    Point getPos() { return pos; }
+    uint width() { return w; }
+    uint height() { return h; }
+
+    /* Bat is drawn at x from now on, wherever it really is; only what
+     * is seen changes, nothing bounces off it there. */
+    void drawAt(coord x) { shown = x; }
+
+    bool isVisible() { return visible; }
+
+    struct State {
+        Point pos;
+        bool visible;
+    };
+
+    State state() const { return State{pos, visible}; }
+    void restore(const State &s) {
+        pos = s.pos;
+        visible = s.visible;
+        refresh();
+    }
+
+    enum Actions {
+        moveLeft, moveRight
+    };
+
+    private:
+    Point   pos = Point(350,750);
+    uint    w = 100, h=10;
+    uint    r = 150, g = 150, b = 150;
+    bool    visible = true;
+    optional<coord> shown;
+};
+
+Mov initialBallMovement(Ball::Direction direction);
+
+class Goal final : public Toy {
+    public:
+    /* Goal line goes from x from to x to, 10 pixels off the top or
+     * bottom of the world. Whole width if to is not told. */
+    Goal(Playground &pg, Player *player, Ball::Direction side,
+         coord from = 0, coord to = 0)
+            : pg(pg), player(player) {
+        if(to == 0)
+            to = pg.width();
+
+        switch(side) {
+            case Ball::up: {
+                coord y = pg.height() - 10;
+                bounds.push_back(Segment(Point(from, y), Point(to, y)));
+                break;
+            }
+            case Ball::down:
+                bounds.push_back(Segment(Point(from, 10), Point(to, 10)));
+                break;
+        }
+    }
+
+    void draw(Canvas &canvas) {}
+    void timePassed(Playground &pg, uint dt) {}
+    void collision() {
+        pg.ballInAGoal(player);
+    }
+    bool destroyed() { return false; }
+
+    private:
+    Playground &pg;
+    Player *player;
+};
+
+struct StreamStats {
+    uint chunks = 0,              // in the playground now
+         boxes = 0,               // of those chunks
+         peakBoxes = 0;
+    unsigned long loaded = 0, unloaded = 0,
+                  waited = 0;     // chunks a ball needed before they came
+};
+
+/* Boxes of a level file, of which only those near the window or near
+ * a ball are in the playground, so memory and tick cost follow what's
+ * around, not how big the world is.
+ *
+ * Every tick it works out which chunks are needed: those the window
+ * overlaps and those with a visible ball, with margin chunks around
+ * them. Missing ones are asked of the loader and come in once read.
+ * Chunks a ball is in or next to can't wait, if they're not there yet
+ * they're read right away. Chunks more than margin + 1 away from all
+ * of that leave: their boxes go out of the playground and are kept
+ * for reuse, only hits each box took are remembered, so broken boxes
+ * stay broken. Boxes in the playground are kept in file's order, the
+ * order decides which of two boxes a ball touching both hits, so the
+ * game goes just as it would with the whole level in.
+ *
+ * Window follows the bat of the player set by following(). Put it in
+ * the playground after world() is set to the level's size. Which boxes
+ * are in depends on how fast the loader is, so it's not for network
+ * games or rollback: snapshots and state() see only boxes that are in
+ * just then. */
+class StreamedLevel final : public Toy {
+    public:
+    StreamedLevel(string path, uint margin = 1)
+        : loader(path), margin(margin) {}
+    ~StreamedLevel();
+
+    StreamedLevel &following(Player *p) {
+        followed = p;
+
+        return *this;
+    }
+
+    uint width() const { return loader.level().width(); }
+    uint height() const { return loader.level().height(); }
+
+    void timePassed(Playground &pg, uint dt);
+    void draw(Canvas &canvas) {}
+
+    /* Everything needed just now comes in at once, read in caller's
+     * thread. That's for before the first tick. */
+    void fill(Playground &pg);
+
+    StreamStats stats() const { return counters; }
+
+    private:
+    // Chunks from col0, row0 to col1, row1, both included.
+    struct Area {
+        int col0, row0, col1, row1;
+    };
+
+    Area around(Point a, Point b);
+    bool near(uint chunk, int distance);
+    void add(Playground &pg, uint chunk, const vector<LevelBox> &boxes);
+    void remove(Playground &pg, uint chunk);
+
+    ChunkLoader loader;
+    int margin;
+    Player *followed = NULL;
+
+    map<uint, vector<Box*> > resident;     // in file's order
+    unordered_set<uint> asked;
+    unordered_map<uint, vector<uint8_t> > hits;   // only chunks hit ever
+    vector<Box*> spare;
+    vector<Area> areas;
+    vector<LevelBox> read;
+    vector<uint> leaving;
+    StreamStats counters;
+};
+
+class GenericPlayer : public Player {
+    public:
+    GenericPlayer(Point position, Ball::Direction direction) 
+            :dir(direction), position(position) {
+        ball = Ball().at(Mov(0, direction * 50).apply(position))
+                     .moving(initialBallMovement(direction));
+        bat = Bat().at(position);
+    }
+    ~GenericPlayer(){
+        if(goal) delete goal;
+    }
+
+    Point getPos() { return bat.getPos(); };
+    void setPos(Point pos) { bat.at(pos); }
+
+    void loose() {
+        if(chances-- <= 0) {
+            ball.hide();
+            bat.hide();
+        }
+    }
+
+    bool defeated() { return chances < 0; }
+    int chancesLeft() { return chances; }
+    void setChances(int n) { chances = n; }
+
+    protected:
+    Bat bat;
+    Ball ball;
+    Goal *goal = NULL;
+    Ball::Direction dir;
+    Point position;
+    int chances = 3;
+};
+
+class LocalPlayer : public GenericPlayer {
+    public:
+    LocalPlayer(Point p, Ball::Direction d) : GenericPlayer(p, d) {}
+    ~LocalPlayer() {};
+
+    LocalPlayer *withKeys(int moveLeft, int moveRight) {
+        lKey = moveLeft;
+        rKey = moveRight;
+
+        return this;
+    }
+
+    void initPlayer(Playground &pg) {
+        pg.with(ball).with(bat).with(*(goal = new Goal(pg, this, dir)))
+            .withKey(lKey, KeyBinding(&bat, (int)Bat::moveLeft))
+            .withKey(rKey, KeyBinding(&bat, (int)Bat::moveRight));
+    }
+
+    Point timePassed(Point other) {
+        return Point(0,0);
+    }
+
+    private:
+    int lKey, rKey;
+};
+
+/* Moves a bat on its own, as if someone pressed the keys. It looks
+ * for the ball that comes towards the bat, works out where the ball
+ * will touch the bat's facing side (bouncing off side walls, ignoring
+ * boxes) and goes there. Skill from 0 to 1 sets how far off the aim can be,
+ * a new error is drawn each time a ball turns towards the bat. */
+class Autopilot final : public Toy {
+    public:
+    Autopilot(Bat &bat, Ball::Direction dir, double skill, uint seed)
+        : bat(bat), dir(dir), skill(skill), rng(seed) {}
+
+    void draw(Canvas &canvas) {}
+
+    void timePassed(Playground &pg, uint dt) {
+        Point me = bat.getPos();
+        optional<int> target;
+        int nearest = 0;
+
+        for(Ball *ball : pg.balls()) {
+            Point p = ball->getPos();
+            Mov v = ball->getVelocity();
+            // dir points where our ball is sent, danger comes the other way
+            if(v.dy == 0 || (v.dy > 0) == (dir == Ball::down))
+                continue;
+
+            // where centre of the ball is when it touches our side
+            int r = ball->radius(),
+                contact = (dir == Ball::down)? me.y + (int) bat.height() + r
+                                             : me.y - r;
+            int ticks = (contact - p.y) / v.dy;
+            if(ticks < 0)
+                continue;
+
+            if(!target || ticks < nearest) {
+                // centre bounces r off the walls
+                target = r + reflect(p.x + v.dx * ticks - r, pg.width() - 2*r);
+                nearest = ticks;
+            }
+        }
+
+        bool incoming = target;
+        if(incoming && !wasIncoming) {
+            /* Sum of 12 uniform numbers less 6 is near enough normal,
+             * deviation 1. Unlike normal_distribution it comes out the
+             * same with any standard library, so do the games. */
+            double err = -6;
+            for(uint i = 0; i < 12; i++)
+                err += rng() / 4294967296.0;
+            aimError = err * (1 - skill) * bat.width();
+        }
+        wasIncoming = incoming;
+
+        if(!target)
+            return;
+
+        int goal = *target + aimError - bat.width() / 2;
+        if(goal < me.x - step)
+            bat.keyPress(Bat::moveLeft);
+        else if(goal > me.x + step)
+            bat.keyPress(Bat::moveRight);
+    }
+
+    // All that changes while the game goes, for Playground::Snapshot.
+    struct State {
+        mt19937 rng;
+        int aimError;
+        bool wasIncoming;
+    };
+
+    State state() const { return State{rng, aimError, wasIncoming}; }
+    void restore(const State &s) {
+        rng = s.rng;
+        aimError = s.aimError;
+        wasIncoming = s.wasIncoming;
+    }
+
+    private:
+    static const int step = 7;
+
+    static int reflect(int x, int w) {
+        int period = 2 * w;
+        x %= period;
+        if(x < 0) x += period;
+
+        return (x > w)? period - x : x;
+    }
+
+    Bat &bat;
+    Ball::Direction dir;
+    double skill;
+    mt19937 rng;
+    int aimError = 0;
+    bool wasIncoming = false;
+};
+
+struct Playground::Snapshot {
+    vector<Ball::State> balls;
+    vector<Bat::State> bats;
+    vector<Box::State> boxes;
+    vector<Autopilot::State> pilots;
+    vector<int> chances;
+};
+
+class BotPlayer : public GenericPlayer {
+    public:
+    BotPlayer(Point p, Ball::Direction d, double skill = 0.8, uint seed = 0)
+        : GenericPlayer(p, d), pilot(bat, d, skill, seed) {}
+    ~BotPlayer() {}
+
+    void initPlayer(Playground &pg) {
+        pg.with(ball).with(bat).with(*(goal = new Goal(pg, this, dir)))
+            .with(pilot);
+    }
+
+    Point timePassed(Point other) {
+        return Point(0,0);
+    }
+
+    private:
+    Autopilot pilot;
+};
+
+/* Rollback: the game goes on right away with remote player's input
+ * guessed, and is put right once the real input comes.
+ *
+ * Input is where a player's bat is at given tick, only x, bats don't
+ * go up and down. Before each tick the whole game is saved into a ring
+ * of depth snapshots. Remote input that isn't here yet is guessed: the
+ * bat goes on the way it went between the two newest known ticks (a
+ * held key moves it evenly), for up to maxAhead ticks. When the real
+ * input comes for a tick that was played with a wrong guess, snapshot
+ * from before that tick is restored and everything since is played
+ * again with what is known by then. The simulation is all integers and
+ * toys go in the same order on both sides, so both end up in the same
+ * state once they have all the inputs.
+ *
+ * The game can't get more than depth ticks ahead of the last tick it
+ * has all inputs for, canAdvance() says when it has to wait. */
+class Rollback {
+    public:
+    Rollback(Playground &pg, Player &remote, uint depth = 64)
+            : pg(pg), remote(remote), depth(depth), snapshots(depth),
+              localX(depth), usedX(depth), remoteX(2 * depth),
+              knownTick(2 * depth, none) {
+        remoteY = remote.getPos().y;
+        startX = remote.getPos().x;
+    }
+
+    /* Call right before the tick is played. Puts things right if
+     * needed, saves the game and tells where the remote bat is. */
+    Point advance(Player &local) {
+        correct(local);
+
+        uint s = frame % depth;
+        pg.save(snapshots[s]);
+        localX[s] = local.getPos().x;
+        usedX[s] = remoteFor(frame);
+        frame++;
+
+        return Point(usedX[s], remoteY);
+    }
+
+    // Plays again whatever was played with a wrong guess.
+    void correct(Player &local) {
+        if(wrongFrom >= frame)
+            return;
+
+        Point me = local.getPos();
+        uint from = wrongFrom;
+        wrongFrom = none;
+
+        pg.restore(snapshots[from % depth]);
+        for(uint t = from; t < frame; t++) {
+            uint s = t % depth;
+            if(t != from)
+                pg.save(snapshots[s]);
+            usedX[s] = remoteFor(t);
+            local.setPos(Point(localX[s], me.y));
+            remote.setPos(Point(usedX[s], remoteY));
+            pg.step();
+            replays++;
+        }
+
+        local.setPos(me);
+    }
+
+    /* Remote inputs are kept from depth ticks back to depth ticks
+     * ahead, the other side may well be ahead of us. */
+    void remoteInput(uint tick, coord x) {
+        if(tick < confirmed || tick >= frame + depth)
+            return;
+
+        uint s = tick % (2 * depth);
+        if(knownTick[s] == tick)
+            return;
+
+        knownTick[s] = tick;
+        remoteX[s] = x;
+        if(tick < frame && usedX[tick % depth] != x)
+            wrongFrom = min(wrongFrom, tick);
+
+        while(known(confirmed))
+            confirmed++;
+    }
+
+    bool canAdvance() const { return frame < confirmed + depth; }
+
+    // Next tick to be played.
+    uint now() const { return frame; }
+    // All remote inputs before this tick are known.
+    uint complete() const { return confirmed; }
+    coord localInput(uint tick) const { return localX[tick % depth]; }
+    uint size() const { return depth; }
+    // Ticks played again so far.
+    unsigned long replayed() const { return replays; }
+
+    /* Where the remote bat is drawn, call it once a frame. The
+     * simulated one jumps whenever a guess is put right, so this one
+     * is showDelay ticks back, where the real input is there already
+     * unless packets are late; then it goes on the way the two newest
+     * real inputs went. Once the late ones come it goes over to the
+     * right place by at most maxCorrection a frame, it doesn't jump.
+     * Nothing until showDelay ticks have been played. */
+    optional<coord> shownX() {
+        if(frame <= showDelay)
+            return optional<coord>();
+
+        coord x = remoteFor(frame - 1 - showDelay);
+        if(!shown)
+            shown = x;
+        else
+            shown = *shown + max(-maxCorrection, min(x - *shown, maxCorrection));
+
+        return shown;
+    }
+
+    static const uint showDelay = 3;
+    static const coord maxCorrection = 14;
+
+    static const uint maxAhead = 8;
+
+    private:
+    static const uint none = ~0u;
+
+    bool known(uint tick) const {
+        return knownTick[tick % (2 * depth)] == tick;
+    }
+
+    coord remoteFor(uint tick) const {
+        if(known(tick))
+            return remoteX[tick % (2 * depth)];
+
+        // two newest known inputs before the tick
+        uint a = none, b = none;
+        for(uint t = tick; t-- > 0 && tick - t < depth && b == none; )
+            if(known(t)) {
+                if(a == none) a = t;
+                else b = t;
+            }
+
+        if(a == none)
+            return startX;
+        coord xa = remoteX[a % (2 * depth)];
+        if(b == none)
+            return xa;
+
+        coord xb = remoteX[b % (2 * depth)];
+        return xa + (xa - xb) * (coord) min(tick - a, maxAhead) / (coord)(a - b);
+    }
+
+    Playground &pg;
+    Player &remote;
+    uint depth;
+    vector<Playground::Snapshot> snapshots;
+    vector<coord> localX, usedX, remoteX;
+    vector<uint> knownTick;
+    coord remoteY, startX;
+
+    uint frame = 0, confirmed = 0, wrongFrom = none;
+    unsigned long replays = 0;
+    optional<coord> shown;
+};
+
+/* Plays the other side of the network. Each tick goes right away,
+ * through Rollback. Inputs go in msg::Input, all those the other side
+ * hasn't confirmed yet, so a lost packet is covered by the next one.
+ * Goals need no messages, both sides simulate them the same way.
+ * Remote bat is drawn where Rollback::shownX() says, smoothly; no
+ * clock sync is needed for that, inputs are numbered by ticks. */
+class RemotePlayer : public GenericPlayer {
+    public:
+    RemotePlayer(NetConnection *conn, Point position, Ball::Direction direction)
+        : GenericPlayer (position, direction), conn(conn) {}
+    ~RemotePlayer() {
+        delete rollback;
+        delete conn;
+    }
+
+    bool wantsUpdates() {return true;}
+    bool ready() { return conn->connected() && rollback->canAdvance(); }
+
+    void initPlayer(Playground &pg) {
+        this->pg = &pg;
+        pg.with(ball).with(bat).with(*(goal = new Goal(pg, this, dir)));
+        rollback = new Rollback(pg, *this);
+    }
+
+    void poll() {
+        if(conn->progress() == linkFailed) {
+            cerr << "Connection failed: " << conn->failure() << endl;
+            pg->quit();
+            return;
+        }
+
+        msg::Control m;
+        while(conn->nextControl(m)) {
+            switch(m.kind) {
+                case ctlPause:
+                    pg->pause(true);
+                    break;
+                case ctlResume:
+                    pg->pause(false);
+                    break;
+                case ctlQuit:
+                    pg->quit();
+                    break;
+            }
+        }
+
+        msg::Input in;
+        string tail;
+        while(conn->take(in, &tail)) {
+            for(uint i = 0; i + 1 < tail.size(); i += 2)
+                rollback->remoteInput(in.first + i / 2,
+                                      (int16_t) read16(&tail[i]));
+            if((Sint32)(in.ack - peerHas) > 0)
+                peerHas = in.ack;
+        }
+
+        // nothing played since, but the other side may be waiting
+        if(conn->connected() && sentAt == rollback->now())
+            sendInputs();
+
+        optional<coord> x = rollback->shownX();
+        if(x)
+            bat.drawAt(*x);
+    }
+
+    Point timePassed(Point other) {
+        Point pos = rollback->advance(*pg->opponentOf(this));
+        sendInputs();
+
+        return pos;
+    }
+
+    void gameEvent(GameEvent e) {
+        switch(e) {
+            case gamePaused:
+                conn->sendControl(ctlPause);
+                break;
+            case gameResumed:
+                conn->sendControl(ctlResume);
+                break;
+            case gameQuit:
+                conn->sendControl(ctlQuit);
+                break;
+        }
+    }
+
+    protected:
+    void sendInputs() {
+        uint now = rollback->now(),
+             first = max(peerHas, now - min(now, rollback->size()));
+
+        msg::Input m;
+        m.first = first;
+        m.ack = rollback->complete();
+
+        string tail;
+        char buf[2];
+        for(uint t = first; t < now; t++) {
+            write16(buf, (uint16_t) rollback->localInput(t));
+            tail.append(buf, 2);
+        }
+
+        conn->send(m, tail);
+        sentAt = now;
+    }
+
+    NetConnection *conn;
+    Playground *pg = NULL;
+    Rollback *rollback = NULL;
+    uint peerHas = 0, sentAt = 0;
+};
+
+class GuestRemote : public RemotePlayer {
+    public:
+    GuestRemote(NetServer *conn, Point position, Ball::Direction direction)
+        : RemotePlayer (conn, position, direction) {}
+};
+
+class HostRemote : public RemotePlayer {
+    public:
+    HostRemote(NetClient *conn, Point position, Ball::Direction direction)
+       : RemotePlayer(conn, position, direction) {} 
+};
+
+/* Where a seat of a relay match is: even seats at the bottom, odd ones
+ * at the top, each side's goal line cut into equal lanes. With two
+ * players that's the usual game. */
+struct SeatPlace {
+    SeatPlace(uint seat, uint players, coord width = 800);
+
+    Ball::Direction dir;
+    coord from, to;     // the lane
+    Point bat;
+};
+
+/* Someone else's seat in a relay match, RelayPlayer moves its bat. */
+class SeatPlayer : public GenericPlayer {
+    public:
+    SeatPlayer(const SeatPlace &place)
+        : GenericPlayer(place.bat, place.dir),
+          from(place.from), to(place.to) {}
+
+    void initPlayer(Playground &pg) {
+        pg.with(ball).with(bat)
+          .with(*(goal = new Goal(pg, this, dir, from, to)));
+    }
+
+    Point timePassed(Point other) {
+        return Point(0,0);
+    }
+
+    protected:
+    coord from, to;
+};
+
+/* Our own seat in a match through RelayServer (see net.hpp).
+ *
+ * Keys move where we want our bat to be, an intent that is never
+ * shown, and it goes to the server every frame. All the bats, ours too,
+ * go only where the server's ticks say, so every client plays the very
+ * same game. A tick is played once it's here; if more than catchUp of
+ * them piled up, all the extra ones are played in one frame. Our bat
+ * follows the keys a round trip late, that's the price. */
+class RelayPlayer : public SeatPlayer {
+    public:
+    RelayPlayer(NetClient *conn, uint seat, uint players)
+        : SeatPlayer(SeatPlace(seat, players)), conn(conn),
+          players(players), frames(history * players),
+          knownTick(history, ~0u) {
+        intent.at(bat.getPos());
+    }
+    ~RelayPlayer() { delete conn; }
+
+    RelayPlayer *withKeys(int moveLeft, int moveRight) {
+        lKey = moveLeft;
+        rKey = moveRight;
+
+        return this;
+    }
+
+    // Players of all the seats in seat order, this one too.
+    RelayPlayer *withSeats(const vector<Player*> &all) {
+        seats = all;
+
+        return this;
+    }
+
+    bool wantsUpdates() {return true;}
+    bool ready() { return have > next; }
+
+    void initPlayer(Playground &pg) {
+        this->pg = &pg;
+        SeatPlayer::initPlayer(pg);
+        pg.withKey(lKey, KeyBinding(&intent, (int)Bat::moveLeft))
+          .withKey(rKey, KeyBinding(&intent, (int)Bat::moveRight));
+    }
+
+    void poll() {
+        if(conn->progress() == linkFailed) {
+            cerr << "Connection failed: " << conn->failure() << endl;
+            pg->quit();
+            return;
+        }
+
+        msg::Frame f;
+        string tail;
+        while(conn->take(f, &tail))
+            for(uint i = 0; 2 * players * (i + 1) <= tail.size(); i++) {
+                uint t = f.first + i;
+                if(t < next || t >= next + history)
+                    continue;
+
+                uint s = t % history;
+                for(uint p = 0; p < players; p++)
+                    frames[s * players + p] =
+                        (int16_t) read16(&tail[2 * (i * players + p)]);
+                knownTick[s] = t;
+            }
+
+        while(knownTick[have % history] == have)
+            have++;
+
+        msg::Move m;
+        m.x = intent.getPos().x;
+        m.ack = have;
+        conn->send(m);
+    }
+
+    Point timePassed(Point other) {
+        while(have > next + 1 + catchUp) {
+            apply(next++);
+            pg->step();
+        }
+        apply(next++);
+
+        return bat.getPos();
+    }
+
+    // Relay server's ticks played so far.
+    uint played() const { return next; }
+
+    static const uint history = 256, catchUp = 2;
+
+    private:
+    void apply(uint tick) {
+        for(uint i = 0; i < seats.size(); i++) {
+            Player *p = seats[i];
+            p->setPos(Point(frames[(tick % history) * players + i],
+                            p->getPos().y));
+        }
+    }
+
+    NetClient *conn;
+    Playground *pg = NULL;
+    vector<Player*> seats;
+    uint players;
+    Bat intent;
+    int lKey = -1, rKey = -1;
+
+    vector<Sint16> frames;
+    vector<uint> knownTick;
+    uint next = 0, have = 0;    // next to play, all before have are here
+};
@@ -0,0 +1,211 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <algorithm>
+
+using namespace std;
+
+class bad_optional : public exception {};
+
+// optional is part of C++17, but not in my compiler :)
+template<class T>
+class optional {
+    public:
+    constexpr optional(): val(), present(false) {}
+    constexpr optional(T value): val(value), present(true){}
+
+    constexpr operator bool() const {return present;}
+    T operator* () {
+        if(!present)
+            throw bad_optional();
+        return val;
+    }
+
+    T* operator-> () {
+        if(!present)
+            throw bad_optional();
+        return &val;
+    }
+
+    private:
+
+    T val;
+    bool present;
+};
+
+inline void write16(void *buff, uint n) {
+    ((char *) buff)[0] = (char)(n & 0xff);
+    ((char *) buff)[1] = (char)((n >> 8) & 0xff);
+}
+
+inline uint read16(const void *buff) {
+    return (((uint)((char*) buff)[0]) & 0xff)
+        + ((((uint)((char*) buff)[1]) << 8) & 0xff00);
+}
+
+struct WrongFormat {};
+
+
+/* Point, Line, Segment, Mov. Classes to be considered in
+ * sense of analytical geometry.
+ *
+ * Everything lives on a signed fixed-point grid with one unit
+ * per pixel. Coordinates are 32-bit, anything multiplied
+ * (line coefficients, squared distances) is kept in 64 bits,
+ * so all the math below is exact integer arithmetic, with no
+ * special cases for vertical lines and no sqrt() needed to
+ * tell which of two points is closer. */
+
+typedef int32_t coord;
+typedef int64_t coord2;
+
+struct Point {
+    constexpr Point(): x(0), y(0) {}
+    constexpr Point(coord x, coord y): x(x), y(y) {}
+    Point(string bin) {
+        if(bin.size() != 4)
+            throw WrongFormat();
+
+        x = (int16_t) read16(bin.data());
+        y = (int16_t) read16(bin.data()+2);
+    };
+
+    // Squared distance, good enough for comparisons.
+    constexpr coord2 dist2(Point b) const {
+        return (coord2)(b.x - x) * (b.x - x)
+             + (coord2)(b.y - y) * (b.y - y);
+    }
+
+    string bin() {
+        char dst[4];
+        write16(dst, (uint16_t) x);
+        write16(dst+2, (uint16_t) y);
+
+        return string(dst, 4);
+    }
+
+    coord x, y;
+};
+
+struct Mov {
+    constexpr Mov(coord dx, coord dy): dx(dx), dy(dy) {}
+
+    constexpr Point apply(Point p) const {
+        return Point(p.x + dx, p.y + dy);
+    }
+
+    coord dx, dy;
+};
+
+/* Line in normal form: a*x + b*y = c. */
+class Line {
+    public:
+    constexpr Line(Point p, Point q)
+        : a(q.y - p.y), b(p.x - q.x),
+          c((coord2)(q.y - p.y) * p.x + (coord2)(p.x - q.x) * p.y) {}
+
+    optional<Point> intersection(Line o) const {
+        // Cramer's rule, it's just 2x2 system of equations.
+        coord2 det = a * o.b - o.a * b;
+        if(det == 0)
+            return optional<Point>();
+
+        return optional<Point>(Point(
+            (c * o.b - o.c * b) / det,
+            (a * o.c - o.a * c) / det
+        ));
+    }
+
+    // Zero on the line, sign tells the side, scaled by sqrt(norm2()).
+    constexpr coord2 side(Point p) const {
+        return a * p.x + b * p.y - c;
+    }
+
+    constexpr coord2 norm2() const {
+        return a * a + b * b;
+    }
+
+    // Line going through p, crossing this one at right angle.
+    constexpr Line perpendicular(Point p) const {
+        return Line(-b, a, -b * p.x + a * p.y);
+    }
+
+    private:
+    constexpr Line(coord2 a, coord2 b, coord2 c): a(a), b(b), c(c) {}
+
+    coord2 a, b, c;
+};
+
+struct Segment {
+    constexpr Segment(Point a, Point b): a(a), b(b), line(a, b) {}
+
+    optional<Point> intersection(Segment s) const {
+        optional<Point> candidate = line.intersection(s.line);
+        if(candidate && candidate->x >= min(a.x, b.x)
+                    && candidate->x <= max(a.x,b.x)
+                    && candidate->x >= min(s.a.x, s.b.x)
+                    && candidate->x <= max(s.a.x, s.b.x)
+                    && candidate->y >= min(a.y, b.y)
+                    && candidate->y <= max(a.y, b.y)
+                    && candidate->y >= min(s.a.y, s.b.y)
+                    && candidate->y <= max(s.a.y, s.b.y))
+
+            return candidate;
+        else
+            return optional<Point>();
+    }
+
+    /* Tells if end of the route s comes within given distance
+     * from this segment. That is perpendicular distance if the
+     * end projects onto the segment, distance to the closer
+     * end otherwise. No division needed: squared distance from
+     * the line is side(p)^2 / |ab|^2, so both sides get
+     * multiplied by |ab|^2 instead. */
+    optional<Point> closePoint(Segment s, uint distance) const {
+        // Distance is meant in whole pixels, rounded down,
+        // so anything closer than distance+1 counts.
+        coord2 limit = (coord2)(distance + 1) * (distance + 1);
+        coord2 len2 = line.norm2(),
+               along = (coord2)(s.b.x - a.x) * (b.x - a.x)
+                     + (coord2)(s.b.y - a.y) * (b.y - a.y);
+
+        bool close;
+        if(along >= 0 && along <= len2 && len2 > 0) {
+            coord2 side = line.side(s.b);
+            close = side * side < limit * len2;
+        } else
+            close = min(a.dist2(s.b), b.dist2(s.b)) < limit;
+
+        if(close)
+            return Point((s.a.x+s.b.x)/2,
+                        (s.a.y+s.b.y)/2);
+
+        return optional<Point>();
+    }
+
+    /* Squared distance of p from the nearest point of the segment,
+     * in doubles, so not exact like Point::dist2(). It's a lower
+     * bound: a bit more than rounding can add is taken off, so the
+     * point is never closer than this. Good for telling how far
+     * something may go safely. */
+    double approxDist2(Point p) const {
+        const double under = 1 - 1e-12;
+        coord2 len2 = line.norm2(),
+               along = (coord2)(p.x - a.x) * (b.x - a.x)
+                     + (coord2)(p.y - a.y) * (b.y - a.y);
+
+        if(along >= 0 && along <= len2 && len2 > 0) {
+            double side = line.side(p);
+            return side * side / len2 * under;
+        }
+
+        return min(a.dist2(p), b.dist2(p)) * under;
+    }
+
+    constexpr Segment moved(Mov m) const {
+        return Segment(m.apply(a), m.apply(b));
+    }
+
+    Point a, b;
+    Line line;
+};
@@ -0,0 +1,183 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cmath>
+
+#include "geometry.hpp"
+
+using namespace std;
+
+/* Floating point math as it used to be, kept here only to
+ * have something to compare against. */
+namespace legacy {
+    struct Point {
+        Point(): x(0), y(0) {}
+        Point(uint x, uint y): x(x), y(y) {}
+
+        uint dist(Point b) {
+            int dx = b.x - x,
+                dy = b.y - y;
+
+            return floor(sqrt(dx*dx + dy*dy));
+        }
+
+        uint x, y;
+    };
+
+    class Line {
+        public:
+        Line(Point a, Point b) {
+            angle = (double)((int)b.y - (int)a.y) / ((int)b.x - (int)a.x);
+
+            if(isinf(angle))
+                x = a.x;
+            else
+                y0 = a.y - angle*a.x;
+        }
+
+        optional<Point> intersection(Line b) {
+            if(angle == b.angle)
+                return optional<Point>();
+
+            if(isinf(angle))
+                return optional<Point>(Point(x, x*b.angle + b.y0));
+
+            if(isinf(b.angle))
+                return optional<Point>(Point(b.x, b.x*angle + y0));
+
+            double x = (b.y0 - y0) / (angle - b.angle);
+            return optional<Point>(Point(x, angle * x + y0));
+        }
+
+        Line perpendicular(Point p) {
+            double a = -(1/angle);
+            if(isinf(a))
+                return Line(a, p.x);
+            else
+                return Line(a, p.y - a * p.x);
+        }
+
+        private:
+        Line(double a, double b) {
+            angle = a;
+            if(isinf(angle))
+                x = b;
+            else
+                y0 = b;
+        }
+
+        double angle, y0, x;
+    };
+
+    struct Segment {
+        Segment(Point a, Point b): a(a), b(b) {}
+
+        optional<Point> closePoint(Segment s, uint distance) {
+            Line base(a,b);
+            Point p1 = *(base.intersection(base.perpendicular(s.b)));
+
+            double d;
+            if(a.x == b.x && p1.y >= min(a.y, b.y)
+                          && p1.y <= max(a.y, b.y))
+                d = p1.dist(s.b);
+            else if(a.y == b.y && p1.x >= min(a.x, b.x)
+                          && p1.x <= max(a.x, b.x))
+                d = p1.dist(s.b);
+            else
+                d = min(a.dist(s.b), b.dist(s.b));
+
+            if(d <= distance)
+                return Point((s.a.x+s.b.x)/2,
+                            (s.a.y+s.b.y)/2);
+
+            return optional<Point>();
+        }
+
+        Point a, b;
+    };
+}
+
+/* Same job Playground::obstacle() does each tick: find closest
+ * boundary near the route. Returns index of the hit, or -1. */
+template<class P, class S, class D>
+int nearest(vector<S> &bounds, S route, uint r, D dist) {
+    optional<P> best;
+    int hit = -1;
+    for(uint i = 0; i < bounds.size(); i++) {
+        optional<P> p = bounds[i].closePoint(route, r);
+        if(p && (!best || dist(*best, route.a) > dist(*p, route.a))) {
+            best = p;
+            hit = i;
+        }
+    }
+
+    return hit;
+}
+
+int main(int argc, char **argv) {
+    uint rounds = (argc > 1)? atoi(argv[1]) : 2000;
+
+    // Level as in the game: 8x8 boxes, 4 edges each.
+    vector<Segment> bounds;
+    vector<legacy::Segment> oldBounds;
+    for(uint x = 0; x < 8; x++)
+        for(uint y = 0; y < 8; y++) {
+            uint px = 200+50*x, py = 200+20*y;
+            uint cx[] = {px, px+50, px+50, px, px},
+                 cy[] = {py, py, py+20, py+20, py};
+            for(uint i = 0; i < 4; i++) {
+                bounds.push_back(Segment(Point(cx[i], cy[i]),
+                                         Point(cx[i+1], cy[i+1])));
+                oldBounds.push_back(legacy::Segment(
+                            legacy::Point(cx[i], cy[i]),
+                            legacy::Point(cx[i+1], cy[i+1])));
+            }
+        }
+
+    mt19937 rng(42);
+    uniform_int_distribution<int> px(150, 650), py(150, 400), v(-6, 6);
+    vector<Segment> routes;
+    vector<legacy::Segment> oldRoutes;
+    for(uint i = 0; i < 1000; i++) {
+        int x = px(rng), y = py(rng), dx = v(rng), dy = v(rng);
+        routes.push_back(Segment(Point(x, y), Point(x+dx, y+dy)));
+        oldRoutes.push_back(legacy::Segment(legacy::Point(x, y),
+                                            legacy::Point(x+dx, y+dy)));
+    }
+
+    typedef chrono::steady_clock clk;
+    long checksum = 0, oldChecksum = 0;
+    uint differ = 0;
+
+    clk::time_point t0 = clk::now();
+    for(uint n = 0; n < rounds; n++)
+        for(Segment &r : routes)
+            checksum += nearest<Point>(bounds, r, 10,
+                    [](Point a, Point b) { return a.dist2(b); });
+
+    clk::time_point t1 = clk::now();
+    for(uint n = 0; n < rounds; n++)
+        for(legacy::Segment &r : oldRoutes)
+            oldChecksum += nearest<legacy::Point>(oldBounds, r, 10,
+                    [](legacy::Point a, legacy::Point b) { return a.dist(b); });
+
+    clk::time_point t2 = clk::now();
+    for(uint i = 0; i < routes.size(); i++)
+        if(nearest<Point>(bounds, routes[i], 10,
+                    [](Point a, Point b) { return a.dist2(b); })
+           != nearest<legacy::Point>(oldBounds, oldRoutes[i], 10,
+                    [](legacy::Point a, legacy::Point b) { return a.dist(b); }))
+            differ++;
+
+    double queries = (double) rounds * routes.size();
+    double fixedNs = chrono::duration<double, nano>(t1 - t0).count() / queries,
+           floatNs = chrono::duration<double, nano>(t2 - t1).count() / queries;
+
+    cout << "segments per query: " << bounds.size() << endl
+         << "fixed-point: " << fixedNs << " ns/query" << endl
+         << "legacy:      " << floatNs << " ns/query" << endl
+         << "speedup:     " << floatNs / fixedNs << "x" << endl
+         << "different hits: " << differ << "/" << routes.size()
+         << " (checksums " << checksum << ", " << oldChecksum << ")" << endl;
+}
@@ -0,0 +1,229 @@
+#include "level.hpp"
+#include "alloc.hpp"
+#include <chrono>
+#include <algorithm>
+
+using namespace std;
+
+static const uint boxBytes = 11;
+
+static void put32(vector<char> &out, uint32_t n) {
+    for(uint i = 0; i < 4; i++)
+        out.push_back((char)((n >> (8*i)) & 0xff));
+}
+
+static uint32_t get32(const char *p) {
+    uint32_t n = 0;
+    for(uint i = 0; i < 4; i++)
+        n |= (uint32_t)(unsigned char) p[i] << (8*i);
+
+    return n;
+}
+
+LevelFile::LevelFile(string path, bool check): file(path.c_str(), ios::binary) {
+    char header[20];
+    if(!file.read(header, 20) || string(header, 8) != "BOUTLVL1")
+        throw LevelException(path + " is not a level");
+
+    w = get32(header + 8);
+    h = get32(header + 12);
+    size = get32(header + 16);
+    // bigger ones would overflow counting chunks
+    const uint maxSide = 1u << 30;
+    if(w == 0 || h == 0 || size == 0 || w > maxSide || h > maxSide
+       || size > maxSide)
+        throw LevelException(path + " has a size it can't have");
+
+    file.seekg(0, ios::end);
+    uint64_t fileSize = file.tellg(),
+             n = (uint64_t) cols() * rows(),
+             boxesFrom = 20 + 8 * n;
+    if(boxesFrom > fileSize)
+        throw LevelException(path + " is cut short");
+
+    vector<char> index(8 * n);
+    file.seekg(20);
+    if(!file.read(index.data(), index.size()))
+        throw LevelException(path + " is cut short");
+
+    offsets.resize(n);
+    counts.resize(n);
+    for(uint i = 0; i < n; i++) {
+        offsets[i] = get32(&index[8*i]);
+        counts[i] = get32(&index[8*i + 4]);
+        if(offsets[i] < boxesFrom
+           || offsets[i] + (uint64_t) boxBytes * counts[i] > fileSize)
+            throw LevelException(path + " has chunks out of the file");
+    }
+
+    if(!check)
+        return;
+
+    vector<LevelBox> boxes;
+    for(uint i = 0; i < n; i++) {
+        read(i, boxes);
+        for(const LevelBox &b : boxes)
+            if(b.x < 0 || b.y < 0 || (uint) b.x >= w || (uint) b.y >= h
+               || chunkAt(Point(b.x, b.y)) != i)
+                throw LevelException(path + " has boxes out of place");
+    }
+}
+
+void LevelFile::write(string path, uint width, uint height, uint chunk,
+                      const vector<LevelBox> &boxes) {
+    uint cols = (width + chunk - 1) / chunk,
+         rows = (height + chunk - 1) / chunk;
+    vector<vector<const LevelBox*> > sorted(cols * rows);
+    for(const LevelBox &b : boxes) {
+        if(b.x < 0 || b.y < 0 || (uint) b.x >= width || (uint) b.y >= height)
+            throw LevelException("box out of the world in " + path);
+        sorted[b.y / chunk * cols + b.x / chunk].push_back(&b);
+    }
+
+    vector<char> out;
+    out.insert(out.end(), "BOUTLVL1", "BOUTLVL1" + 8);
+    put32(out, width);
+    put32(out, height);
+    put32(out, chunk);
+
+    uint32_t offset = out.size() + 8 * sorted.size();
+    for(auto &c : sorted) {
+        put32(out, offset);
+        put32(out, c.size());
+        offset += boxBytes * c.size();
+    }
+
+    for(auto &c : sorted)
+        for(const LevelBox *b : c) {
+            put32(out, b->x);
+            put32(out, b->y);
+            out.push_back((char) b->r);
+            out.push_back((char) b->g);
+            out.push_back((char) b->b);
+        }
+
+    ofstream f(path.c_str(), ios::binary);
+    if(!f.write(out.data(), out.size()))
+        throw LevelException("can't write " + path);
+}
+
+void LevelFile::read(uint chunk, vector<LevelBox> &out) {
+    out.resize(counts[chunk]);
+    buffer.resize(boxBytes * counts[chunk]);
+
+    file.clear();
+    if(!file.seekg(offsets[chunk]) || !file.read(buffer.data(), buffer.size()))
+        throw LevelException("level is cut short");
+
+    for(uint i = 0; i < out.size(); i++) {
+        const char *p = &buffer[boxBytes * i];
+        out[i].x = (coord) get32(p);
+        out[i].y = (coord) get32(p + 4);
+        out[i].r = p[8];
+        out[i].g = p[9];
+        out[i].b = p[10];
+    }
+}
+
+uint LevelFile::chunkAt(Point p) const {
+    uint col = min((uint) max(p.x, 0) / size, cols() - 1),
+         row = min((uint) max(p.y, 0) / size, rows() - 1);
+
+    return row * cols() + col;
+}
+
+// index has checked the file, once is enough
+ChunkLoader::ChunkLoader(string path): index(path), file(path, false) {
+    worker = thread(&ChunkLoader::reader, this);
+}
+
+ChunkLoader::~ChunkLoader() {
+    {
+        lock_guard<mutex> l(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    worker.join();
+}
+
+void ChunkLoader::want(uint chunk) {
+    {
+        lock_guard<mutex> l(lock);
+        if(find(wanted.begin(), wanted.end(), chunk) != wanted.end())
+            return;
+        wanted.push_back(chunk);
+    }
+    wake.notify_one();
+}
+
+void ChunkLoader::forget(uint chunk) {
+    lock_guard<mutex> l(lock);
+    // front one may be being read just now
+    auto i = find(wanted.begin(), wanted.end(), chunk);
+    if(i != wanted.end() && i != wanted.begin())
+        wanted.erase(i);
+}
+
+bool ChunkLoader::take(uint &chunk, vector<LevelBox> &boxes) {
+    lock_guard<mutex> l(lock);
+    if(ready.empty())
+        return false;
+
+    chunk = ready.front().first;
+    swap(boxes, ready.front().second);
+    // what caller had is read into next time
+    spare.push_back(move(ready.front().second));
+    ready.pop_front();
+
+    return true;
+}
+
+void ChunkLoader::readNow(uint chunk, vector<LevelBox> &boxes) {
+    index.read(chunk, boxes);
+
+    lock_guard<mutex> l(lock);
+    counters.readNow++;
+    counters.boxes += boxes.size();
+}
+
+LoaderStats ChunkLoader::stats() {
+    lock_guard<mutex> l(lock);
+    return counters;
+}
+
+void ChunkLoader::reader() {
+    AllocScope scope(alloc::level);
+    unique_lock<mutex> l(lock);
+
+    while(true) {
+        wake.wait(l, [this]() { return stopping || !wanted.empty(); });
+        if(stopping)
+            break;
+
+        uint chunk = wanted.front();
+        vector<LevelBox> boxes;
+        if(!spare.empty()) {
+            swap(boxes, spare.back());
+            spare.pop_back();
+        }
+        l.unlock();
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        try {
+            file.read(chunk, boxes);
+        } catch(LevelException &e) {
+            // broken file, the chunk comes empty rather than never
+            boxes.clear();
+        }
+        double secs = chrono::duration<double>(
+                chrono::steady_clock::now() - start).count();
+
+        l.lock();
+        // it stays in wanted while read, so it isn't queued twice
+        wanted.pop_front();
+        counters.read++;
+        counters.boxes += boxes.size();
+        ready.push_back(make_pair(chunk, move(boxes)));
+        counters.readerSeconds += secs;
+    }
+}
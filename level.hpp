@@ -0,0 +1,115 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#include "geometry.hpp"
+
+using namespace std;
+
+struct LevelException {
+    LevelException(string msg): msg(msg) {}
+
+    string msg;
+};
+
+// Box as a level file has it: top left corner and colour.
+struct LevelBox {
+    coord x, y;
+    uint8_t r, g, b;
+};
+
+/* Level file, for worlds too big to be kept in memory all at once.
+ * The world is cut into square chunks, chunk x chunk pixels each,
+ * numbered row by row. A box belongs to the chunk its top left
+ * corner is in, boxes of a chunk are stored together, so a chunk is
+ * read with one seek.
+ *
+ * File starts with "BOUTLVL1", world width, height and chunk size,
+ * then index: offset of chunk's boxes from the start of the file and
+ * their count, for every chunk. All of those are uint32. Box is int32
+ * x, y and r, g, b bytes. All numbers are little endian.
+ *
+ * Index is read when the file is opened, boxes only by read(). With
+ * check, the file is read through once when opened, to see that every
+ * chunk is within the file and every box is in the world and in its
+ * own chunk; anything wrong throws LevelException then, not once the
+ * game goes. */
+class LevelFile {
+    public:
+    LevelFile(string path, bool check = true);
+
+    /* Boxes are sorted into chunks here, in any order they come.
+     * Throws if any is outside the world. */
+    static void write(string path, uint width, uint height, uint chunk,
+                      const vector<LevelBox> &boxes);
+
+    // Boxes of the chunk, in place of whatever out had.
+    void read(uint chunk, vector<LevelBox> &out);
+
+    uint width() const { return w; }
+    uint height() const { return h; }
+    uint chunkSize() const { return size; }
+    uint cols() const { return (w + size - 1) / size; }
+    uint rows() const { return (h + size - 1) / size; }
+    uint chunks() const { return counts.size(); }
+    uint boxesIn(uint chunk) const { return counts[chunk]; }
+
+    // Chunk the point is in, points outside go to the nearest one.
+    uint chunkAt(Point p) const;
+
+    private:
+    ifstream file;
+    uint w, h, size;
+    vector<uint32_t> offsets, counts;
+    vector<char> buffer;
+};
+
+struct LoaderStats {
+    unsigned long read = 0,       // chunks read by the thread
+                  readNow = 0,    // chunks that couldn't wait
+                  boxes = 0;
+    double readerSeconds = 0;
+};
+
+/* Reads chunks of a level file in a thread of its own, so the game
+ * doesn't wait for the disk.
+ *  want()     queues chunk for reading, unless it's there already.
+ *  forget()   takes it off the queue, if it wasn't read yet. It may
+ *             still come out of take(), caller has to drop it then.
+ *  take()     gives a chunk that has been read, false if none is.
+ *  readNow()  reads the chunk in caller's thread, when it can't wait.
+ * Chunks come out of take() in the order they were wanted. */
+class ChunkLoader {
+    public:
+    ChunkLoader(string path);
+    ~ChunkLoader();
+
+    const LevelFile &level() const { return index; }
+
+    void want(uint chunk);
+    void forget(uint chunk);
+    bool take(uint &chunk, vector<LevelBox> &boxes);
+    void readNow(uint chunk, vector<LevelBox> &boxes);
+
+    LoaderStats stats();
+
+    private:
+    void reader();
+
+    LevelFile index, file;
+    deque<uint> wanted;
+    deque<pair<uint, vector<LevelBox> > > ready;
+    vector<vector<LevelBox> > spare;   // buffers to read into, reused
+    bool stopping = false;
+    LoaderStats counters;
+
+    mutex lock;
+    condition_variable wake;
+    thread worker;
+};
@@ -1,95 +1,1162 @@
 #include "net.hpp"
+#include "geometry.hpp"
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <random>
+
+#ifdef NET_MMSG
+#include <unistd.h>
+#include <cerrno>
+#endif
 
 using namespace std;
 
+#ifdef NET_TEST
+// Share of packets thrown away instead of sent, to see retransmissions.
+static int lossPercent = 0;
+#endif
+
 NetException::NetException() {
     msg = SDLNet_GetError();
 }
 
-NetConnection::NetConnection(uint port) {
+#ifdef NET_MMSG
+const bool UdpSocket::canShare = true;
+
+UdpSocket::UdpSocket(uint port, bool share)
+        : inData(batch * msg::maxPacket), outData(batch * msg::maxPacket),
+          inMsgs(batch), outMsgs(batch), inVecs(batch), outVecs(batch),
+          inAddrs(batch), outAddrs(batch) {
+    int on = 1;
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    if((fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0)
+        throw NetException(strerror(errno));
+    if((share && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+       || bind(fd, (sockaddr *) &addr, sizeof(addr))) {
+        NetException e(strerror(errno));
+        close(fd);
+        throw e;
+    }
+
+    // buffers and addresses never move, headers can point at them once
+    for(uint i = 0; i < batch; i++) {
+        inVecs[i].iov_base = &inData[i * msg::maxPacket];
+        inVecs[i].iov_len = msg::maxPacket;
+        outVecs[i].iov_base = &outData[i * msg::maxPacket];
+
+        memset(&inMsgs[i], 0, sizeof(mmsghdr));
+        inMsgs[i].msg_hdr.msg_iov = &inVecs[i];
+        inMsgs[i].msg_hdr.msg_iovlen = 1;
+        inMsgs[i].msg_hdr.msg_name = &inAddrs[i];
+
+        memset(&outMsgs[i], 0, sizeof(mmsghdr));
+        outMsgs[i].msg_hdr.msg_iov = &outVecs[i];
+        outMsgs[i].msg_hdr.msg_iovlen = 1;
+        outMsgs[i].msg_hdr.msg_name = &outAddrs[i];
+        outMsgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+    }
+}
+
+UdpSocket::~UdpSocket() {
+    flush();
+    close(fd);
+}
+
+bool UdpSocket::receive(string &data, IPaddress &from) {
+    if(taken == received) {
+        for(uint i = 0; i < batch; i++)
+            inMsgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+
+        int n = recvmmsg(fd, inMsgs.data(), batch, MSG_DONTWAIT, NULL);
+        taken = 0;
+        received = (n > 0)? n : 0;
+        if(!received)
+            return false;
+    }
+
+    uint i = taken++;
+    data.assign((char *) inVecs[i].iov_base, inMsgs[i].msg_len);
+    from.host = inAddrs[i].sin_addr.s_addr;
+    from.port = inAddrs[i].sin_port;
+
+    return true;
+}
+
+bool UdpSocket::send(const string &data, const IPaddress &to) {
+    if(data.size() > msg::maxPacket) {
+        lastErrno = EMSGSIZE;
+        return false;
+    }
+
+    memcpy(outVecs[queued].iov_base, data.data(), data.size());
+    outVecs[queued].iov_len = data.size();
+    memset(&outAddrs[queued], 0, sizeof(sockaddr_in));
+    outAddrs[queued].sin_family = AF_INET;
+    outAddrs[queued].sin_addr.s_addr = to.host;
+    outAddrs[queued].sin_port = to.port;
+
+    return (++queued < batch)? true : flush();
+}
+
+/* Datagram that can't go is dropped, as it would be on the way,
+ * the rest of the queue is still sent. The socket doesn't block, a full
+ * send buffer (EAGAIN) is just such a drop, not an error. */
+bool UdpSocket::flush() {
+    bool ok = true;
+    for(uint done = 0; done < queued; ) {
+        int n = sendmmsg(fd, &outMsgs[done], queued - done, 0);
+        if(n < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                lastErrno = errno;
+                ok = false;
+            }
+            n = 1;
+        }
+        done += n;
+    }
+    queued = 0;
+
+    return ok;
+}
+
+string UdpSocket::error() const {
+    return strerror(lastErrno);
+}
+#else
+const bool UdpSocket::canShare = false;
+
+UdpSocket::UdpSocket(uint port, bool share) {
     if(SDLNet_Init() < 0
-       || !(connection = SDLNet_UDP_Open(port))
-       || !(packet = SDLNet_AllocPacket(8)))
+       || !(socket = SDLNet_UDP_Open(port))
+       || !(packet = SDLNet_AllocPacket(msg::maxPacket)))
        throw NetException();
 }
 
-NetConnection::~NetConnection() {
+UdpSocket::~UdpSocket() {
     SDLNet_FreePacket(packet);
-    SDLNet_UDP_Close(connection);
+    SDLNet_UDP_Close(socket);
     SDLNet_Quit();
 }
 
-void NetConnection::send(string message) {
-    packet->len = 8;
-    memcpy(packet->data, &myPacketNo, 4);
-    myPacketNo++;
-    memcpy(packet->data+4, message.c_str(), 4);
-    if(SDLNet_UDP_Send(connection, -1, packet) == 0)
-        throw NetException();
+bool UdpSocket::receive(string &data, IPaddress &from) {
+    if(SDLNet_UDP_Recv(socket, packet) <= 0)
+        return false;
+
+    data.assign((char *) packet->data, packet->len);
+    from = packet->address;
+
+    return true;
 }
 
-string NetConnection::receive() {
-    bool success = false;
-    while(!success) {
-        time_t started_at = time(NULL);
-        while(SDLNet_UDP_Recv(connection, packet) == 0) {
-            time_t now = time(NULL);
-            if(now - started_at > 5)
-                throw RecvTimeout();
+bool UdpSocket::send(const string &data, const IPaddress &to) {
+    if(data.size() > (uint) packet->maxlen) {
+        SDLNet_SetError("packet too big");
+        return false;
+    }
+
+    memcpy(packet->data, data.data(), data.size());
+    packet->len = data.size();
+    packet->address = to;
+
+    return SDLNet_UDP_Send(socket, -1, packet) != 0;
+}
+
+bool UdpSocket::flush() {
+    return true;
+}
+
+string UdpSocket::error() const {
+    return SDLNet_GetError();
+}
+#endif
+
+const Uint32 ReliableChannel::minTimeout, ReliableChannel::maxTimeout;
+
+void ReliableChannel::send(ControlKind kind, int arg, Uint32 now) {
+    Pending p;
+    p.m.id = nextId++;
+    p.m.kind = kind;
+    p.m.arg = arg;
+    p.sentAt = now;
+    p.deadline = now + timeout;
+    p.retries = 0;
+    pending.push_back(p);
+
+    conn.send(p.m);
+}
+
+void ReliableChannel::handle(const msg::Packet &p, Uint32 now) {
+    msg::Control m;
+    msg::Ack ack;
+
+    if(p.read(m)) {
+        Uint16 id = m.id;
+        Sint16 ahead = id - expected;
+        if(ahead == 0) {
+            delivered.push_back(m);
+            expected++;
+            for(auto e = early.find(expected); e != early.end();
+                     e = early.find(expected)) {
+                delivered.push_back(e->second);
+                early.erase(e);
+                expected++;
+            }
+        } else if(ahead > 0 && ahead <= 32)
+            early[id] = m;
+
+        // duplicates get acked too, the first ack may have been lost
+        acknowledge();
+    } else if(p.read(ack)) {
+        for(uint i = 0; i < pending.size(); ) {
+            Sint16 d = (Uint16)(pending[i].m.id - ack.base);
+            if(d < 0 || (d > 0 && d <= 32 && (ack.mask >> (d - 1)) & 1)) {
+                if(pending[i].retries == 0)
+                    sample(now - pending[i].sentAt);
+                pending.erase(pending.begin() + i);
+            } else
+                i++;
         }
+    }
+}
+
+void ReliableChannel::acknowledge() {
+    msg::Ack ack;
+    ack.base = expected;
+    ack.mask = 0;
+    for(auto &e : early) {
+        Uint16 d = e.first - expected;
+        if(d >= 1 && d <= 32)
+            ack.mask |= 1u << (d - 1);
+    }
 
-        uint counter;
-        memcpy(&counter, packet->data, 4);
-        if(counter > hisPacketNo) {
-            success = true;
-            hisPacketNo = counter;
+    conn.send(ack);
+}
+
+void ReliableChannel::sample(Uint32 rtt) {
+    if(!measured) {
+        srtt = rtt;
+        rttvar = rtt / 2.0;
+        measured = true;
+    } else {
+        rttvar = 0.75 * rttvar + 0.25 * fabs(srtt - rtt);
+        srtt = 0.875 * srtt + 0.125 * rtt;
+    }
+
+    double rto = srtt + max(4 * rttvar, 1.0);
+    timeout = min(max((Uint32) rto, minTimeout), maxTimeout);
+}
+
+void ReliableChannel::update(Uint32 now) {
+    for(Pending &p : pending)
+        if((Sint32)(now - p.deadline) >= 0) {
+            p.retries++;
+            p.deadline = now + min(timeout << min(p.retries, 6u), maxTimeout);
+            resent++;
+            conn.send(p.m);
         }
+}
+
+bool ReliableChannel::next(msg::Control &m) {
+    if(delivered.empty())
+        return false;
+
+    m = delivered.front();
+    delivered.pop_front();
+
+    return true;
+}
+
+NetConnection::NetConnection(uint port)
+        : socket(port), control(*this), state(linkListening) {
+    remote.host = remote.port = 0;
+}
+
+NetConnection::~NetConnection() {
+    // things like "quit" are usually the last thing said
+    flush(500);
+}
+
+void NetConnection::fail(string why) {
+    state = linkFailed;
+    error = why;
+}
+
+/* Goes out right away, a batch would only add latency here. */
+void NetConnection::sendPacket(const string &bytes) {
+#ifdef NET_TEST
+    if(rand() % 100 < lossPercent)
+        return;
+#endif
+
+    if(!socket.send(bytes, remote) || !socket.flush())
+        throw NetException(socket.error());
+}
+
+/* Reads one packet if there is any. Hellos go to the handshake,
+ * control messages to the channel, positions to the inbox, unless
+ * older than what came already. */
+bool NetConnection::readPacket() {
+    if(!socket.receive(datagram, from))
+        return false;
+
+    msg::Packet p(datagram);
+    if(!p.valid())
+        return true;
+
+    Uint32 now = SDL_GetTicks();
+    msg::Hello hello;
+    if(p.read(hello)) {
+        greeted(hello);
+        if(fromRemote())
+            lastHeard = now;
+        return true;
+    }
+
+    // nobody else keeps the link alive
+    if(!fromRemote())
+        return true;
+    lastHeard = now;
+
+    // server talks only to those who said hello, so that's an answer
+    if(state == linkConnecting)
+        state = linkConnected;
+    else if(state != linkConnected)
+        return true;
+
+    if(p.type() == msg::Control::type || p.type() == msg::Ack::type)
+        control.handle(p, now);
+    else if((Sint16)(p.seq() - hisPacketNo) > 0) {
+        hisPacketNo = p.seq();
+        if(inbox.size() == inboxLimit)
+            inbox.pop_front();
+        inbox.push_back(p);
     }
-    return string((char *)(packet->data) + 4, 4);
+
+    return true;
 }
 
-void NetServer::establishConnection() {
-    for(uint i = 0; i < 10; i++) {
-        try {
-            receive();
+void NetConnection::poll() {
+    while(readPacket());
+
+    Uint32 now = SDL_GetTicks();
+    if(state == linkConnecting)
+        retry(now);
+    else if(state == linkConnected) {
+        if(now - lastHeard > silenceTimeout) {
+            fail("peer went silent");
             return;
-        } catch (RecvTimeout e) {}
-        cerr << "Waiting for client..." << endl;
+        }
+
+        control.update(now);
     }
 }
 
-NetServer::NetServer() : NetConnection(4242) {
-    establishConnection();
+void NetConnection::sendControl(ControlKind kind, int arg) {
+    control.send(kind, arg, SDL_GetTicks());
+}
+
+void NetConnection::flush(Uint32 ms) {
+    Uint32 started = SDL_GetTicks();
+    while(connected() && !control.idle() && SDL_GetTicks() - started < ms) {
+        poll();
+        SDL_Delay(1);
+    }
 }
 
-NetServer::~NetServer() {}
+NetServer::NetServer() : NetConnection(4242) {}
+
+void NetServer::greeted(const msg::Hello &hello) {
+    // the first to say hello is the peer, for as long as the match goes
+    if(state == linkListening) {
+        state = linkConnected;
+        remote = from;
+    } else if(!fromRemote())
+        return;
+
+    // answer every hello of his, client repeats it until one gets through
+    sendPacket(msg::encode(hello, myPacketNo++));
+}
+
+const Uint32 NetClient::firstBackoff, NetClient::maxBackoff;
+
+NetClient::NetClient(string hostname, uint port, uint localPort)
+        : NetConnection(localPort) {
+    random_device seed;
+    nonce = seed();
+    state = linkConnecting;
+
+    if(SDLNet_ResolveHost(&remote, hostname.c_str(), port)) {
+        fail("can't resolve " + hostname);
+        return;
+    }
+
+    sayHello(SDL_GetTicks());
+}
+
+void NetClient::greeted(const msg::Hello &hello) {
+    if(state == linkConnecting && hello.nonce == nonce)
+        state = linkConnected;
+}
+
+void NetClient::retry(Uint32 now) {
+    if((Sint32)(now - nextHello) < 0)
+        return;
+
+    if(hellos == maxHellos)
+        fail("no answer from server");
+    else
+        sayHello(now);
+}
+
+void NetClient::sayHello(Uint32 now) {
+    msg::Hello hello;
+    hello.nonce = nonce;
+    try {
+        sendPacket(msg::encode(hello, myPacketNo++));
+    } catch(NetException e) {
+        fail(e.msg);
+        return;
+    }
+
+    hellos++;
+    nextHello = now + backoff;
+    backoff = min(backoff * 2, maxBackoff);
+}
+
+const Uint32 RelayServer::tickInterval, RelayServer::clientTimeout;
+const uint RelayServer::history, RelayServer::maxPlayers, RelayServer::none;
+
+RelayServer::RelayServer(uint players, uint port, uint matches)
+        : socket(port), players(min(max(players, 1u), maxPlayers)),
+          maxMatches(max(matches, 1u)) {}
+
+static uint64_t addressKey(const IPaddress &a) {
+    return ((uint64_t) a.host << 16) | a.port;
+}
+
+void RelayServer::poll() {
+    Uint32 now = SDL_GetTicks();
+    receive(now);
+    if((Sint32)(now - nextSweep) >= 0) {
+        dropSilent(now);
+        nextSweep = now + clientTimeout / 20;
+    }
+
+    msg::Seat seat;
+    seat.players = players;
+    for(Match &m : matches) {
+        if(!m.running) {
+            // seats go again once a tick, till everyone answered
+            if((Sint32)(now - m.nextTick) < 0)
+                continue;
+            m.nextTick = now + tickInterval;
+
+            bool all = m.seats.size() == players;
+            for(uint i = 0; i < m.seats.size(); i++) {
+                if(m.seats[i] == none) {
+                    all = false;
+                    continue;
+                }
+                Client &c = clients[m.seats[i]];
+                seat.seat = i;
+                if(!c.moved)
+                    sendTo(c, seat);
+                all = all && c.moved;
+            }
+
+            if(!all)
+                continue;
+            m.running = true;
+            m.nextTick = now;
+            counters.matches++;
+        }
+
+        // too far behind, what's missed is just skipped
+        if((Sint32)(now - m.nextTick) > (Sint32) tickInterval * 4)
+            m.nextTick = now;
+        while((Sint32)(now - m.nextTick) >= 0) {
+            closeTick(m);
+            m.nextTick += tickInterval;
+        }
+    }
+    socket.flush();
+}
+
+/* New client, in the first match that waits for players and has room,
+ * else in a new one. NULL if there is no room anywhere. */
+RelayServer::Client *RelayServer::seat(const IPaddress &addr, Uint32 now) {
+    uint match = none, place = none;
+    for(uint i = 0; i < matches.size() && match == none; i++) {
+        Match &m = matches[i];
+        if(m.running)
+            continue;
+        auto empty = find(m.seats.begin(), m.seats.end(), none);
+        if(empty != m.seats.end() || m.seats.size() < players) {
+            match = i;
+            place = empty - m.seats.begin();
+        }
+    }
 
-NetClient::NetClient(string hostname) : NetConnection(4241) {
-    IPaddress addr;
-    if(SDLNet_ResolveHost(&addr, hostname.c_str(), 4242))
+    if(match == none) {
+        if(matches.size() == maxMatches)
+            return NULL;
+        matches.push_back(Match());
+        matches.back().frames.resize(history * players);
+        match = matches.size() - 1;
+        place = 0;
+    }
+
+    uint id = clients.size();
+    if(!unused.empty()) {
+        id = unused.back();
+        unused.pop_back();
+    } else
+        clients.push_back(Client());
+
+    Client &c = clients[id];
+    c.addr = addr;
+    c.match = match;
+    c.x = 0;
+    c.ack = 0;
+    c.lastHeard = now;
+    c.moved = false;
+
+    Match &m = matches[match];
+    if(place == m.seats.size())
+        m.seats.push_back(id);
+    else
+        m.seats[place] = id;
+    byAddress[addressKey(addr)] = id;
+    counters.players++;
+
+    return &c;
+}
+
+/* Lets go of clients gone silent. A match nobody is left in is over,
+ * it starts afresh, waiting for players. */
+void RelayServer::dropSilent(Uint32 now) {
+    for(Match &m : matches) {
+        bool anyone = false;
+        for(uint &id : m.seats) {
+            if(id == none)
+                continue;
+            Client &c = clients[id];
+            if(now - c.lastHeard <= clientTimeout) {
+                anyone = true;
+                continue;
+            }
+
+            byAddress.erase(addressKey(c.addr));
+            unused.push_back(id);
+            id = none;
+            counters.left++;
+        }
+
+        if(anyone || m.seats.empty())
+            continue;
+        if(m.running)
+            counters.ended++;
+        m.seats.clear();
+        m.running = false;
+        m.tick = 0;
+        fill(m.frames.begin(), m.frames.end(), 0);
+    }
+}
+
+void RelayServer::receive(Uint32 now) {
+    IPaddress from;
+    while(socket.receive(datagram, from)) {
+        msg::Packet p(datagram);
+        if(!p.valid())
+            continue;
+        counters.packetsIn++;
+        counters.bytesIn += datagram.size();
+
+        auto known = byAddress.find(addressKey(from));
+        Client *c = (known == byAddress.end())? NULL : &clients[known->second];
+        if(c)
+            c->lastHeard = now;
+
+        msg::Hello hello;
+        if(p.read(hello)) {
+            if(!c)
+                c = seat(from, now);
+            if(c)
+                sendTo(*c, hello);
+            continue;
+        }
+
+        if(!c)
+            continue;
+
+        msg::Move move;
+        msg::Ping ping;
+        if(p.read(move)) {
+            c->moved = true;
+            c->x = move.x;
+            if((Sint32)(move.ack - c->ack) > 0)
+                c->ack = move.ack;
+        } else if(p.read(ping)) {
+            msg::Pong pong;
+            pong.sent = ping.sent;
+            sendTo(*c, pong);
+        }
+    }
+}
+
+void RelayServer::closeTick(Match &m) {
+    Sint16 *row = &m.frames[(m.tick % history) * players],
+           *before = &m.frames[((m.tick + history - 1) % history) * players];
+    // bat of one who left stays where it was
+    for(uint i = 0; i < players; i++)
+        row[i] = (m.seats[i] != none)? clients[m.seats[i]].x : before[i];
+    m.tick++;
+    counters.ticks++;
+
+    char buf[2];
+    string tail;
+    for(uint seat : m.seats) {
+        if(seat == none)
+            continue;
+        Client &c = clients[seat];
+        // one that fell behind the history can't catch up anymore
+        msg::Frame f;
+        f.first = max(c.ack, m.tick - min(m.tick, history));
+        Uint32 last = min(m.tick, f.first + maxFrames);
+
+        tail.clear();
+        for(Uint32 t = f.first; t < last; t++)
+            for(uint i = 0; i < players; i++) {
+                write16(buf, (uint16_t) m.frames[(t % history) * players + i]);
+                tail.append(buf, 2);
+            }
+        sendTo(c, f, tail);
+    }
+}
+
+void RelayServer::sendTo(const Client &c, const string &packet) {
+    socket.send(packet, c.addr);
+    counters.packetsOut++;
+    counters.bytesOut += packet.size();
+}
+
+SpectatorHub::SpectatorHub(uint port, uint queueDepth, uint shards)
+        : depth(queueDepth), ring(queueDepth) {
+    if(!UdpSocket::canShare)
+        shards = 1;
+
+    for(uint i = 0; i < max(shards, 1u); i++)
+        this->shards.emplace_back(new Shard(port, shards > 1));
+    for(unique_ptr<Shard> &s : this->shards)
+        s->sender = thread(&SpectatorHub::pump, this, ref(*s));
+}
+
+SpectatorHub::~SpectatorHub() {
+    {
+        lock_guard<mutex> l(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for(unique_ptr<Shard> &s : shards)
+        s->sender.join();
+}
+
+void SpectatorHub::broadcast(const string &state) {
+    msg::State m;
+    {
+        lock_guard<mutex> l(lock);
+        m.tick = seq;
+    }
+    shared_ptr<const string> update(new string(
+            msg::encode(m, m.tick, state.substr(0, maxState))));
+
+    {
+        lock_guard<mutex> l(lock);
+        ring[seq % depth] = update;
+        seq++;
+        counters.updates++;
+    }
+    wake.notify_all();
+}
+
+SpectatorStats SpectatorHub::stats() {
+    lock_guard<mutex> l(lock);
+    return counters;
+}
+
+void SpectatorHub::acceptJoins(Shard &shard, Uint32 now, Uint32 last) {
+    string datagram;
+    IPaddress from;
+    while(shard.socket.receive(datagram, from)) {
+        msg::Join join;
+        if(!msg::Packet(datagram).read(join))
+            continue;
+
+        bool known = false;
+        for(Spectator &s : shard.spectators)
+            if(s.addr.host == from.host && s.addr.port == from.port) {
+                s.lastSeen = now;
+                known = true;
+            }
+
+        if(!known) {
+            Spectator s;
+            s.addr = from;
+            s.lastSeen = now;
+            s.next = last;
+            shard.spectators.push_back(s);
+        }
+    }
+}
+
+void SpectatorHub::pump(Shard &shard) {
+    const uint burst = 2;
+    vector<shared_ptr<const string> > updates;
+    vector<Spectator> &spectators = shard.spectators;
+    Uint32 sent = 0, last;
+
+    while(true) {
+        {
+            unique_lock<mutex> l(lock);
+            wake.wait_for(l, chrono::milliseconds(5),
+                          [&]() { return stopping || seq != sent; });
+            if(stopping)
+                return;
+
+            updates = ring;
+            last = seq;
+        }
+
+        Uint32 now = SDL_GetTicks();
+        acceptJoins(shard, now, last);
+
+        unsigned long long packets = 0, bytes = 0, skipped = 0;
+        bool more = true;
+        while(more) {
+            more = false;
+            for(Spectator &s : spectators) {
+                if(last - s.next > depth) {
+                    skipped += last - s.next - depth;
+                    s.next = last - depth;
+                }
+
+                for(uint i = 0; i < burst && s.next != last; i++, s.next++) {
+                    const string &u = *updates[s.next % depth];
+                    shard.socket.send(u, s.addr);
+                    packets++;
+                    bytes += u.size();
+                }
+                more = more || s.next != last;
+            }
+        }
+        shard.socket.flush();
+        sent = last;
+
+        for(uint i = 0; i < spectators.size(); )
+            if(now - spectators[i].lastSeen > spectatorTimeout) {
+                spectators[i] = spectators.back();
+                spectators.pop_back();
+            } else
+                i++;
+
+        lock_guard<mutex> l(lock);
+        counters.spectators += spectators.size() - shard.counted;
+        shard.counted = spectators.size();
+        counters.packets += packets;
+        counters.bytes += bytes;
+        counters.skipped += skipped;
+    }
+}
+
+SpectatorClient::SpectatorClient(string hostname, uint port) : socket(0) {
+    if(SDLNet_ResolveHost(&hub, hostname.c_str(), port))
         throw NetException();
-    packet->address = addr;
 
-    establishConnection();
+    join();
 }
 
-void NetClient::establishConnection() {
-    send("ping");
+void SpectatorClient::join() {
+    socket.send(msg::encode(msg::Join(), 0), hub);
+    socket.flush();
+    lastJoin = SDL_GetTicks();
 }
 
-NetClient::~NetClient(){}
+bool SpectatorClient::poll(string &state) {
+    if(SDL_GetTicks() - lastJoin > SpectatorHub::spectatorTimeout / 4)
+        join();
+
+    IPaddress from;
+    bool fresh = false;
+    while(socket.receive(datagram, from)) {
+        msg::Packet p(datagram);
+        msg::State m;
+        string tail;
+        if(p.read(m, &tail) && (!any || (Sint32)(m.tick - lastSeq) > 0)) {
+            any = fresh = true;
+            lastSeq = m.tick;
+            state = tail;
+        }
+    }
+
+    return fresh;
+}
 
 #ifdef NET_TEST
+/* Run without arguments for server, with server's hostname for client.
+ * Client connects, sends a few positions and control messages, server
+ * prints what it gets: positions may be lost, controls must all come,
+ * in order. NET_LOSS=percent drops that many outgoing packets. */
 int main(int argc, char **argv) {
     bool server = (argc < 2);
+    if(getenv("NET_LOSS"))
+        lossPercent = atoi(getenv("NET_LOSS"));
 
     if(server) {
         NetServer srv;
-        cout << srv.receive() << endl;
+        while(srv.progress() != linkConnected)
+            SDL_Delay(1);
+
+        msg::Control m;
+        bool quit = false;
+        while(!quit) {
+            srv.poll();
+            if(!srv.connected()) {
+                cout << srv.failure() << endl;
+                return 1;
+            }
+
+            msg::BatPos pos;
+            while(srv.take(pos))
+                cout << "position " << pos.x << endl;
+            while(srv.nextControl(m)) {
+                cout << "control " << m.kind << " " << m.arg << endl;
+                quit = (m.kind == ctlQuit);
+            }
+            SDL_Delay(1);
+        }
     } else {
-        NetClient(argv[1]).send("Hello World!\n");
+        Uint32 start = SDL_GetTicks();
+        NetClient client(argv[1]);
+        LinkState s;
+        while((s = client.progress()) == linkConnecting)
+            SDL_Delay(1);
+
+        cout << ((s == linkConnected)? "connected" : client.failure().c_str())
+             << " after " << SDL_GetTicks() - start << " ms" << endl;
+        if(s != linkConnected)
+            return 1;
+
+        msg::BatPos pos;
+        for(uint i = 0; i < 20; i++) {
+            pos.x = i;
+            client.send(pos);
+            client.sendControl(ctlPause, i);
+            client.poll();
+            SDL_Delay(16);
+        }
+        client.sendControl(ctlQuit);
+        client.flush(5000);
+
+        cout << client.channel().retransmissions() << " retransmissions, rto "
+             << client.channel().rto() << " ms" << endl;
+    }
+}
+#endif
+
+#ifdef SPECTATOR_BENCH
+#include <ctime>
+#include <sys/resource.h>
+
+static double cpuSeconds(clockid_t clock) {
+    timespec t;
+    clock_gettime(clock, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Hub and spectators in one process, over loopback, the game sending
+ * 60 states a second, as big as the stock level's. Hub's own CPU time
+ * is what the process used minus the main thread, which plays both
+ * the game and all the spectators. */
+int main(int argc, char **argv) {
+    uint seconds = (argc > 1)? atoi(argv[1]) : 5;
+    const uint stateSize = 30;
+
+    rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+
+    for(uint n : {100, 1000}) {
+        SpectatorHub hub;
+        vector<SpectatorClient*> clients;
+        for(uint i = 0; i < n; i++) {
+            clients.push_back(new SpectatorClient("127.0.0.1"));
+            if(i % 100 == 99)
+                SDL_Delay(20);
+        }
+
+        string state(stateSize, 'x');
+        // a join may still get lost, they're repeated every few seconds
+        for(uint t = 0; t < 100 && hub.stats().spectators < n; t++) {
+            SDL_Delay(50);
+            for(SpectatorClient *c : clients)
+                c->poll(state);
+        }
+
+        unsigned long long delivered = 0;
+        double process0 = cpuSeconds(CLOCK_PROCESS_CPUTIME_ID),
+               main0 = cpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+        Uint32 start = SDL_GetTicks();
+
+        for(uint tick = 0; tick < seconds * 60; tick++) {
+            hub.broadcast(state);
+            Sint32 wait = start + (tick + 1) * 1000 / 60 - SDL_GetTicks();
+            if(wait > 0)
+                SDL_Delay(wait);
+            for(SpectatorClient *c : clients)
+                delivered += c->poll(state);
+        }
+
+        double hubCpu = (cpuSeconds(CLOCK_PROCESS_CPUTIME_ID) - process0)
+                      - (cpuSeconds(CLOCK_THREAD_CPUTIME_ID) - main0);
+        SpectatorStats st = hub.stats();
+
+        cout << n << " spectators: " << st.spectators << " joined, "
+             << 100.0 * delivered / (60.0 * seconds * n) << "% of states delivered, "
+             << st.skipped << " skipped" << endl
+             << "  hub CPU " << 100 * hubCpu / seconds << "% of a core, "
+             << 1e6 * hubCpu / seconds / n << " us/s per spectator" << endl
+             << "  " << (double) st.bytes / seconds / n << " B/s per spectator ("
+             << (st.bytes + 28 * st.packets) / seconds / n
+             << " B/s with UDP/IP headers)" << endl;
+
+        for(SpectatorClient *c : clients)
+            delete c;
+    }
+}
+#endif
+
+#ifdef TRANSPORT_BENCH
+#include <atomic>
+
+static double seconds() {
+    return chrono::duration<double>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Packets per second over loopback, through whichever UdpSocket this
+ * was built with; make transport_bench builds both. Datagrams are as
+ * big as a State for the stock level.
+ *
+ * First what one packet costs each side: receiver's queue is filled,
+ * then drained, and both are timed separately, so it's the system
+ * calls that get measured, not how threads take turns. Then sustained
+ * rate: one thread sends from many ports as fast as it can, shards
+ * sharing the port drain it, a thread each. */
+int main(int argc, char **argv) {
+    double duration = (argc > 1)? atof(argv[1]) : 2;
+    const uint port = 4250, size = 40, fill = 200;
+    string data(size, 'x');
+    IPaddress to;
+    SDLNet_ResolveHost(&to, "127.0.0.1", port);
+
+    cout << (UdpSocket::canShare? "Linux sockets, recvmmsg/sendmmsg"
+                                : "SDL_net") << endl;
+    {
+        UdpSocket in(port), out(0);
+        string got;
+        IPaddress from;
+        unsigned long long sent = 0, received = 0;
+        double sending = 0, draining = 0, start = seconds();
+
+        while(seconds() - start < duration) {
+            double t0 = seconds();
+            for(uint i = 0; i < fill; i++)
+                out.send(data, to);
+            out.flush();
+            double t1 = seconds();
+            while(in.receive(got, from))
+                received++;
+            double t2 = seconds();
+
+            sent += fill;
+            sending += t1 - t0;
+            draining += t2 - t1;
+        }
+
+        cout << "  send  " << sent / sending / 1e3 << " kpps" << endl
+             << "  drain " << received / draining / 1e3 << " kpps ("
+             << 100.0 * received / sent << "% delivered)" << endl;
+    }
+
+    for(uint shards : {1, 2, 4}) {
+        if(shards > 1 && !UdpSocket::canShare)
+            break;
+
+        vector<unique_ptr<UdpSocket> > in, out;
+        for(uint i = 0; i < shards; i++)
+            in.emplace_back(new UdpSocket(port, shards > 1));
+        for(uint i = 0; i < 64; i++)
+            out.emplace_back(new UdpSocket(0));
+
+        atomic<bool> stop(false);
+        atomic<unsigned long long> received(0);
+        vector<thread> drains;
+        for(uint i = 0; i < shards; i++)
+            drains.push_back(thread([&, i]() {
+                string got;
+                IPaddress from;
+                unsigned long long n = 0;
+                while(!stop)
+                    while(in[i]->receive(got, from))
+                        n++;
+                received += n;
+            }));
+
+        unsigned long long sent = 0;
+        double start = seconds();
+        while(seconds() - start < duration)
+            for(unique_ptr<UdpSocket> &o : out) {
+                for(uint i = 0; i < UdpSocket::batch; i++)
+                    o->send(data, to);
+                o->flush();
+                sent += UdpSocket::batch;
+            }
+        double took = seconds() - start;
+
+        SDL_Delay(50);
+        stop = true;
+        for(thread &t : drains)
+            t.join();
+
+        cout << "  " << shards << " shard(s): " << received / took / 1e3
+             << " kpps received of " << sent / took / 1e3 << " kpps sent" << endl;
+    }
+}
+#endif
+
+#ifdef RELAY_BENCH
+#include <ctime>
+#include <atomic>
+
+/* A match of n players over loopback, for seconds each. Server runs in
+ * its own thread, polling every millisecond, its CPU time is what that
+ * thread used since the match started. Clients live in main
+ * thread and do what RelayPlayer does, with bats wandering at random.
+ * All of them must end up with the very same ticks. What the same
+ * match would cost without the server, everyone sending its bat to
+ * everyone else 60 times a second, is worked out from the size of
+ * msg::Move. */
+int main(int argc, char **argv) {
+    uint seconds = (argc > 1)? atoi(argv[1]) : 3;
+    const uint port = 4245;
+
+    for(uint n : {2, 4, 6, 8}) {
+        RelayServer server(n, port);
+        atomic<bool> stop(false);
+        double cpu = 0;
+        thread relay([&]() {
+            timespec t;
+            while(!stop) {
+                bool before = server.started();
+                server.poll();
+                if(server.started() && !before) {
+                    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+                    cpu = -(t.tv_sec + t.tv_nsec / 1e9);
+                }
+                SDL_Delay(1);
+            }
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+            cpu += t.tv_sec + t.tv_nsec / 1e9;
+        });
+
+        struct Side {
+            NetClient *conn;
+            bool seated = false;
+            Sint16 x = 350;
+            Uint32 have = 0;
+            uint64_t hash = 1469598103934665603ull;
+        };
+        vector<Side> sides(n);
+        for(Side &s : sides)
+            s.conn = new NetClient("127.0.0.1", port, 0);
+
+        mt19937 rng(n);
+        Uint32 start = SDL_GetTicks(), started = 0;
+        for(uint frame = 0; !started || SDL_GetTicks() - started < seconds * 1000;
+            frame++) {
+            for(Side &s : sides) {
+                s.conn->progress();
+                msg::Seat seat;
+                s.seated = s.seated || s.conn->take(seat);
+
+                msg::Frame f;
+                string tail;
+                while(s.conn->take(f, &tail))
+                    if(f.first <= s.have && f.first + tail.size() / (2 * n) > s.have) {
+                        // FNV-1a of every tick, in order, once
+                        for(uint i = 2 * n * (s.have - f.first); i < tail.size(); i++)
+                            s.hash = (s.hash ^ (uint8_t) tail[i]) * 1099511628211ull;
+                        s.have = f.first + tail.size() / (2 * n);
+                    }
+
+                if(s.seated) {
+                    s.x += 7 * ((Sint16)(rng() % 3) - 1);
+                    msg::Move m;
+                    m.x = s.x;
+                    m.ack = s.have;
+                    s.conn->send(m);
+                }
+            }
+
+            if(!started && server.started())
+                started = SDL_GetTicks();
+            if(SDL_GetTicks() - start > 10000)
+                break;
+
+            Sint32 wait = start + (frame + 1) * 1000 / 60 - SDL_GetTicks();
+            if(wait > 0)
+                SDL_Delay(wait);
+        }
+
+        // last few ticks to come
+        SDL_Delay(100);
+        for(Side &s : sides)
+            s.conn->poll();
+        stop = true;
+        relay.join();
+
+        RelayStats st = server.stats();
+        Uint32 fewest = ~0u, most = 0;
+        bool same = true;
+        for(Side &s : sides) {
+            fewest = min(fewest, s.have);
+            most = max(most, s.have);
+        }
+        // compare what all have seen, up to the tick everyone got to
+        for(Side &s : sides)
+            same = same && s.have == fewest && s.hash == sides[0].hash;
+
+        double span = st.ticks * RelayServer::tickInterval / 1000.0;
+        uint move = msg::encode(msg::Move(), 0).size() + 28;
+        cout << n << " players: " << st.ticks << " ticks, clients have "
+             << fewest << ".." << most << (same? ", all the same" : "") << endl
+             << "  server CPU " << 100 * cpu / span << "% of a core, "
+             << 1e6 * cpu / max(st.ticks, 1ull) << " us/tick" << endl
+             << "  per client: down " << (st.bytesOut + 28 * st.packetsOut) / span / n
+             << " B/s, up " << (st.bytesIn + 28 * st.packetsIn) / span / n
+             << " B/s; peer to peer " << (n - 1) * move * 60
+             << " B/s each way" << endl;
+
+        for(Side &s : sides)
+            delete s.conn;
     }
 }
 #endif
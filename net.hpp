@@ -1,48 +1,441 @@
 #pragma once
 #include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "SDL_net.h"
+#include "protocol.hpp"
+
+#ifdef NET_MMSG
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
 
 using namespace std;
 
 struct NetException {
     NetException();
+    NetException(string msg): msg(msg) {}
 
     string msg;
 };
 
-struct RecvTimeout {};
+/* UDP socket all the networking here goes through. There are two
+ * builds of it, picked by the Makefile (NET=mmsg):
+ *  default   SDL_net, one system call for each datagram.
+ *  NET_MMSG  Linux sockets directly. receive() takes up to batch
+ *            datagrams with one recvmmsg() and hands them out one by
+ *            one; send() only queues, flush() sends the whole queue
+ *            with one sendmmsg(), as does send() once batch is full.
+ *            With share, more sockets can bind the same port
+ *            (SO_REUSEPORT). Kernel then spreads senders among them by
+ *            their address, so each can be served by its own thread.
+ *
+ * Addresses are IPaddress either way, host and port in network order.
+ * send() and flush() return false if something couldn't go, error()
+ * says why. A datagram dropped for a full send buffer doesn't count,
+ * UDP may lose it anyway. */
+class UdpSocket {
+    public:
+    UdpSocket(uint port, bool share = false);
+    ~UdpSocket();
+
+    // False if nothing is waiting.
+    bool receive(string &data, IPaddress &from);
+    bool send(const string &data, const IPaddress &to);
+    bool flush();
+
+    string error() const;
+
+    static const uint batch = 32;
+    // Whether share does anything in this build.
+    static const bool canShare;
+
+    private:
+#ifdef NET_MMSG
+    int fd;
+    int lastErrno = 0;
+    uint received = 0, taken = 0, queued = 0;
+    vector<char> inData, outData;
+    vector<mmsghdr> inMsgs, outMsgs;
+    vector<iovec> inVecs, outVecs;
+    vector<sockaddr_in> inAddrs, outAddrs;
+#else
+    UDPsocket socket;
+    UDPpacket *packet;
+#endif
+};
+
+// What control messages say, arg tells the details.
+enum ControlKind {
+    ctlPause,
+    ctlResume,
+    ctlQuit
+};
+
+/* Where connection setup is:
+ *  linkListening   server, nobody said hello yet.
+ *  linkConnecting  client, saying hello until it's answered.
+ *  linkConnected   both sides can talk.
+ *  linkFailed      client gave up, see failure(). */
+enum LinkState {
+    linkListening, linkConnecting, linkConnected, linkFailed
+};
+
+class NetConnection;
+
+/* Reliable, ordered delivery of few small control messages over the
+ * same socket as the bat positions.
+ *
+ * Each control message gets its own id. Receiver answers every one of
+ * them with msg::Ack: the id it waits for next, plus a bit for each of
+ * the 32 after it that already came (selective ack), so one lost packet
+ * costs one retransmission, not the whole window. Messages that came
+ * early wait until the gap is filled, next() hands them out in order.
+ *
+ * Unacknowledged messages are sent again after retransmission timeout,
+ * computed from measured round trips as in TCP (RFC 6298): smoothed RTT
+ * plus four times its variation, doubled with each retry of the same
+ * message. Only messages sent once are measured, ack of a retransmitted
+ * one can't tell which copy it answers.
+ *
+ * Positions don't go through this at all, they never wait for a lost
+ * control message to be resent. */
+class ReliableChannel {
+    public:
+    ReliableChannel(NetConnection &conn): conn(conn) {}
+
+    void send(ControlKind kind, int arg, Uint32 now);
+    // Takes msg::Control or msg::Ack, anything else is ignored.
+    void handle(const msg::Packet &p, Uint32 now);
+    // Retransmits whatever is due.
+    void update(Uint32 now);
+
+    // Next message in order, false if there is none yet.
+    bool next(msg::Control &m);
+    bool ready() const { return !delivered.empty(); }
+    // True when everything sent was acknowledged.
+    bool idle() const { return pending.empty(); }
+
+    Uint32 rto() const { return timeout; }
+    unsigned long retransmissions() const { return resent; }
+
+    static const Uint32 minTimeout = 30, maxTimeout = 3000;
+
+    private:
+    struct Pending {
+        msg::Control m;
+        Uint32 sentAt, deadline;
+        uint retries;
+    };
+
+    void acknowledge();
+    void sample(Uint32 rtt);
+
+    NetConnection &conn;
+    Uint16 nextId = 0, expected = 0;
+    deque<Pending> pending;
+    map<Uint16, msg::Control> early;
+    deque<msg::Control> delivered;
+
+    bool measured = false;
+    double srtt = 0, rttvar = 0;
+    Uint32 timeout = 200;
+    unsigned long resent = 0;
+};
 
 class NetConnection {
     public:
     NetConnection(uint port);
     virtual ~NetConnection();
 
-    void send(string message);
-    string receive();
+    // Dropped until connected, there is nobody to send it to.
+    template<class M>
+    void send(const M &message, const string &tail = "") {
+        if(state == linkConnected)
+            sendPacket(msg::encode(message, myPacketNo++, tail));
+    }
+
+    /* Moves connection setup on without waiting: reads what came,
+     * says hello again when it's time. Call it every frame, it
+     * tells how it's going. */
+    LinkState progress() {
+        poll();
+        return state;
+    }
+
+    bool connected() const { return state == linkConnected; }
+    const string &failure() const { return error; }
+
+    /* Takes next message of given type that came already, anything
+     * else before it is dropped. Never waits, false if there's none. */
+    template<class M>
+    bool take(M &message, string *tail = NULL) {
+        while(!inbox.empty()) {
+            msg::Packet p = inbox.front();
+            inbox.pop_front();
+            if(p.read(message, tail))
+                return true;
+        }
 
-    virtual void establishConnection() = 0;
+        return false;
+    }
+
+    /* Reads everything that came, doesn't wait. Gives up on the peer
+     * after silenceTimeout ms without a word; players send their
+     * input every frame, paused or not, so that never happens while
+     * the other side is there. */
+    void poll();
+
+    void sendControl(ControlKind kind, int arg = 0);
+    bool nextControl(msg::Control &m) { return control.next(m); }
+    const ReliableChannel &channel() const { return control; }
+
+    // Waits up to ms until all control messages are acknowledged.
+    void flush(Uint32 ms);
 
     protected:
-    void commonInit();
+    // Hello came from the other side.
+    virtual void greeted(const msg::Hello &hello) = 0;
+    // Called by poll() while connecting.
+    virtual void retry(Uint32 now) {}
 
-    Uint32    myPacketNo = 1,
+    void fail(string why);
+    void sendPacket(const string &bytes);
+    bool readPacket();
+    bool fromRemote() const {
+        return from.host == remote.host && from.port == remote.port;
+    }
+
+    Uint16    myPacketNo = 1,
               hisPacketNo = 0;
-    UDPpacket *packet;
-    UDPsocket connection;
+    UdpSocket socket;
+    IPaddress remote, from;     // the peer, sender of last packet
+    string    datagram;
+    deque<msg::Packet> inbox;
+    ReliableChannel control;
+    LinkState state;
+    string error;
+
+    Uint32 lastHeard = 0;
+
+    static const uint inboxLimit = 64;
+    static const Uint32 silenceTimeout = 5000;
 };
 
+/* Handshake: client sends msg::Hello with random nonce, server answers
+ * each hello with the same message. The first one to say hello is the
+ * server's peer from then on, hellos of anyone else are ignored, so
+ * nobody can take the match over. Client is connected once it gets
+ * its nonce back, or anything else from the server, which talks only to
+ * those who said hello. Lost hellos are repeated with exponential
+ * backoff, after maxHellos of them client gives up. Nothing here waits,
+ * game keeps calling progress() and shows the level meanwhile. */
 class NetServer : public NetConnection {
     public:
     NetServer();
-    ~NetServer();
 
-    void establishConnection();
+    protected:
+    void greeted(const msg::Hello &hello);
 };
 
 class NetClient : public NetConnection {
     public:
-    NetClient(string hostname);
-    ~NetClient();
-    
-    void establishConnection();
+    // localPort 0 takes any that is free.
+    NetClient(string hostname, uint port = 4242, uint localPort = 4241);
+
+    static const Uint32 firstBackoff = 25, maxBackoff = 800;
+    static const uint maxHellos = 8;
+
+    protected:
+    void greeted(const msg::Hello &hello);
+    void retry(Uint32 now);
+
+    private:
+    void sayHello(Uint32 now);
+
+    uint32_t nonce;
+    uint hellos = 0;
+    Uint32 backoff = firstBackoff, nextHello = 0;
+};
+
+struct RelayStats {
+    uint players = 0,                 // seated so far
+         left = 0,                    // of them, gone silent since
+         matches = 0,                 // started so far
+         ended = 0;                   // of them, everyone left since
+    unsigned long long ticks = 0,     // closed, all matches together
+                       packetsIn = 0, bytesIn = 0,
+                       packetsOut = 0, bytesOut = 0;
+};
+
+/* Server of matches of up to 8 players. It only relays, the game is
+ * simulated by the clients, all of them the same way.
+ *
+ * Clients connect as NetClient does to NetServer. They get seats in
+ * order they said hello: the first players of them in the first match,
+ * the next ones in another, up to matches of them at once; anyone after
+ * that is not answered. Each seated client gets msg::Seat until it
+ * sends its first msg::Move, and a match starts once all its seats are
+ * taken.
+ *
+ * A client not heard from for clientTimeout ms is gone. Before the
+ * match starts its seat goes to the next one who says hello; once it
+ * runs the bat stays where it was. A match everyone has left is over,
+ * the server doesn't simulate games, so that's how it learns of it,
+ * and its place goes to a new match.
+ *
+ * From then on each match keeps its own clock: every tickInterval ms
+ * it closes a tick with the newest x each client asked for (the one it
+ * had before if nothing came) and sends every client one msg::Frame
+ * with all the ticks the client hasn't acknowledged yet, up to
+ * maxFrames of them. So each client sends and gets one packet a tick,
+ * whose size grows with the number of players, where everyone sending
+ * to everyone else would take a packet to each of them. Nobody waits
+ * for a slow client, it just moves its bat late.
+ *
+ * Not threaded, poll() does everything, call it often. */
+class RelayServer {
+    public:
+    RelayServer(uint players, uint port = 4242, uint matches = 1);
+
+    void poll();
+    // True once the first match started.
+    bool started() const { return counters.matches > 0; }
+    const RelayStats &stats() const { return counters; }
+
+    static const Uint32 tickInterval = 17, clientTimeout = 5000;
+    static const uint history = 256, maxFrames = 16, maxPlayers = 8;
+
+    private:
+    static const uint none = ~0u;
+
+    struct Client {
+        IPaddress addr;
+        uint      match;
+        Sint16    x;
+        Uint32    ack, lastHeard;
+        bool      moved;
+    };
+
+    struct Match {
+        vector<uint> seats;     // clients, index is the seat, none if empty
+        vector<Sint16> frames;  // history ticks x players
+        bool running = false;
+        Uint32 tick = 0, nextTick = 0;
+    };
+
+    void receive(Uint32 now);
+    Client *seat(const IPaddress &addr, Uint32 now);
+    void dropSilent(Uint32 now);
+    void closeTick(Match &m);
+    void sendTo(const Client &c, const string &packet);
+    template<class M>
+    void sendTo(const Client &c, const M &m, const string &tail = "") {
+        sendTo(c, msg::encode(m, myPacketNo++, tail));
+    }
+
+    UdpSocket socket;
+    uint players, maxMatches;
+    vector<Client> clients;
+    vector<uint> unused;                        // of clients, to reuse
+    vector<Match> matches;
+    unordered_map<uint64_t, uint> byAddress;    // host, port to client
+    Uint32 nextSweep = 0;
+    Uint16 myPacketNo = 1;
+    string datagram;
+    RelayStats counters;
+};
+
+struct SpectatorStats {
+    uint spectators = 0;
+    unsigned long long updates = 0,   // states broadcast by the game
+                       packets = 0,   // packets sent to spectators
+                       bytes = 0,
+                       skipped = 0;   // updates a spectator never got
+};
+
+/* Read-only viewers of a match. They join by sending "join" to the
+ * hub's port and keep sending it every couple of seconds, or they are
+ * forgotten after spectatorTimeout ms.
+ *
+ * broadcast() is called by the game each tick. It only stores the
+ * update in a small ring and wakes the sender thread, so the game does
+ * the same amount of work for one spectator or for a thousand. The
+ * sender thread keeps a cursor into the ring for each spectator and
+ * sends what each one is missing, a few packets per spectator per
+ * round, so nobody gets starved by others. A spectator that falls more
+ * than queueDepth updates behind skips the old ones, it gets the most
+ * recent state rather than a growing backlog.
+ *
+ * With more shards, each has its own socket on the same port and its
+ * own sender thread, serving spectators whose joins came to its socket
+ * (see UdpSocket, that needs the NET_MMSG build, otherwise there is
+ * just one shard).
+ *
+ * Updates go as msg::State with the state in tail, joins as msg::Join. */
+class SpectatorHub {
+    public:
+    SpectatorHub(uint port = 4243, uint queueDepth = 4, uint shards = 1);
+    ~SpectatorHub();
+
+    void broadcast(const string &state);
+    SpectatorStats stats();
+
+    static const uint maxState = msg::maxPacket - 16;
+    static const Uint32 spectatorTimeout = 10000;
+
+    private:
+    struct Spectator {
+        IPaddress addr;
+        Uint32    lastSeen;
+        Uint32    next;
+    };
+
+    struct Shard {
+        Shard(uint port, bool share): socket(port, share) {}
+
+        UdpSocket socket;
+        vector<Spectator> spectators;
+        uint counted = 0;       // of spectators, in counters
+        thread sender;
+    };
+
+    void pump(Shard &shard);
+    void acceptJoins(Shard &shard, Uint32 now, Uint32 last);
+
+    uint depth;
+    vector<unique_ptr<Shard> > shards;
+
+    vector<shared_ptr<const string> > ring;
+    Uint32 seq = 0;
+    bool stopping = false;
+    SpectatorStats counters;
+
+    mutex lock;
+    condition_variable wake;
+};
+
+/* The other end: joins a hub and collects the updates. */
+class SpectatorClient {
+    public:
+    SpectatorClient(string hostname, uint port = 4243);
+
+    /* Takes all the packets waiting, keeps the newest state. Returns
+     * true if there is a new one since last time. */
+    bool poll(string &state);
+
+    private:
+    void join();
+
+    UdpSocket socket;
+    IPaddress hub;
+    string datagram;
+    Uint32 lastSeq = 0, lastJoin = 0;
+    bool any = false;
 };
@@ -0,0 +1,255 @@
+#include "protocol.hpp"
+
+using namespace std;
+
+namespace msg {
+
+void BitWriter::bits(uint64_t value, uint n) {
+    while(n > 0) {
+        uint take = (n > 32)? 32 : n;
+        acc |= (value & ((1ULL << take) - 1)) << used;
+        used += take;
+        value >>= take;
+        n -= take;
+
+        while(used >= 8) {
+            out += (char)(acc & 0xff);
+            acc >>= 8;
+            used -= 8;
+        }
+    }
+}
+
+void BitWriter::field(int64_t value, int64_t lo, int64_t hi, int64_t step) {
+    if(value < lo) value = lo;
+    if(value > hi) value = hi;
+
+    uint64_t steps = (hi - lo) / step,
+             q = (value - lo + step / 2) / step;
+    bits((q > steps)? steps : q, bitsFor(steps));
+}
+
+void BitWriter::flush() {
+    if(used > 0)
+        out += (char)(acc & 0xff);
+    acc = 0;
+    used = 0;
+}
+
+uint64_t BitReader::bits(uint n) {
+    uint64_t result = 0;
+    uint got = 0;
+
+    while(n > 0) {
+        uint byte = pos / 8, off = pos % 8;
+        if(byte >= size) {
+            overrun = true;
+            return 0;
+        }
+
+        uint take = (8 - off < n)? 8 - off : n;
+        uint64_t chunk = ((unsigned char) data[byte] >> off) & ((1u << take) - 1);
+        result |= chunk << got;
+        got += take;
+        pos += take;
+        n -= take;
+    }
+
+    return result;
+}
+
+int64_t BitReader::field(int64_t lo, int64_t hi, int64_t step) {
+    int64_t value = lo + (int64_t) bits(bitsFor((hi - lo) / step)) * step;
+
+    return (value > hi)? hi : value;
+}
+
+const char *name(uint type) {
+    switch(type) {
+#define PROTOCOL_NAME(Name, id) case id: return #Name;
+        PROTOCOL_MESSAGES(PROTOCOL_NAME)
+#undef PROTOCOL_NAME
+        default: return "unknown";
+    }
+}
+
+// CRC-16/CCITT-FALSE, table driven.
+static struct CrcTable {
+    CrcTable() {
+        for(uint i = 0; i < 256; i++) {
+            uint16_t c = i << 8;
+            for(uint j = 0; j < 8; j++)
+                c = (c & 0x8000)? (c << 1) ^ 0x1021 : c << 1;
+            t[i] = c;
+        }
+    }
+
+    uint16_t t[256];
+} crcTable;
+
+uint16_t crc16(const char *data, uint size) {
+    uint16_t crc = 0xffff;
+    for(uint i = 0; i < size; i++)
+        crc = (crc << 8) ^ crcTable.t[((crc >> 8) ^ (unsigned char) data[i]) & 0xff];
+
+    return crc;
+}
+
+void putHeader(BitWriter &out, uint type, uint16_t seq) {
+    out.bits(version, 4);
+    out.bits(type, 6);
+    out.bits(seq, 16);
+}
+
+void seal(string &packet) {
+    uint16_t crc = crc16(packet.data(), packet.size());
+    packet += (char)(crc & 0xff);
+    packet += (char)(crc >> 8);
+}
+
+Packet::Packet(const string &bytes): good(false) {
+    if(bytes.size() < headerBits / 8 + 2)
+        return;
+
+    uint n = bytes.size() - 2;
+    uint16_t crc = (unsigned char) bytes[n]
+                 | ((unsigned char) bytes[n + 1] << 8);
+    if(crc != crc16(bytes.data(), n))
+        return;
+
+    BitReader in(bytes.data(), n);
+    if(in.bits(4) != version)
+        return;
+
+    kind = in.bits(6);
+    number = in.bits(16);
+    body.assign(bytes, 0, n);
+    good = in.ok();
+}
+
+}
+
+#ifdef PROTOCOL_TEST
+#include <iostream>
+#include <random>
+#include <chrono>
+
+/* Fuzzing the codec: random messages must come back as sent (after
+ * clamping to their ranges), damaged packets must never be accepted
+ * as valid and garbage must never crash the decoder. Then it measures
+ * how fast it goes. */
+
+using namespace msg;
+
+static mt19937_64 rng(1);
+
+static int64_t anyValue(int64_t lo, int64_t hi) {
+    // mostly in range, sometimes way out of it
+    uniform_int_distribution<int64_t> in(lo, hi), out(lo - 1000, hi + 1000);
+    return (rng() % 8)? in(rng) : out(rng);
+}
+
+static int64_t clamped(int64_t v, int64_t lo, int64_t hi) {
+    return (v < lo)? lo : (v > hi)? hi : v;
+}
+
+static uint failures = 0, escaped = 0, attempts = 0;
+
+static void check(bool ok, const char *what) {
+    if(!ok && failures++ < 20)
+        cerr << "FAIL: " << what << endl;
+}
+
+static void corrupt(const string &packet) {
+    uint bitsTotal = packet.size() * 8;
+    for(uint flips = 1; flips <= 2; flips++) {
+        string bad = packet;
+        for(uint i = 0; i < flips; i++) {
+            uint b = rng() % bitsTotal;
+            bad[b / 8] ^= 1 << (b % 8);
+        }
+        check(bad == packet || !Packet(bad).valid(), "bit flip accepted");
+    }
+
+    // 16-bit checksum lets one in 65536 random damages through
+    string cut = packet.substr(0, rng() % packet.size());
+    attempts++;
+    escaped += Packet(cut).valid();
+}
+
+#define PROTOCOL_FIELD_RANDOM(type, name, lo, hi, step) \
+    int64_t name##_sent = anyValue(lo, hi);                         \
+    m.name = (type) name##_sent;
+#define PROTOCOL_FIELD_CHECK(type, name, lo, hi, step) \
+    check((int64_t) back.name == clamped((int64_t)(type) name##_sent, lo, hi), \
+          #name " came back wrong");
+
+#define PROTOCOL_ROUNDTRIP(Name, id)                                \
+    for(uint i = 0; i < rounds; i++) {                              \
+        msg::Name m;                                                \
+        Name##_FIELDS(PROTOCOL_FIELD_RANDOM)                        \
+        string tail(rng() % 8, 'x');                                \
+        uint16_t seq = rng();                                       \
+        string packet = encode(m, seq, tail);                       \
+        Packet p(packet);                                           \
+        msg::Name back;                                             \
+        string backTail;                                            \
+        check(p.valid() && p.type() == id && p.seq() == seq,        \
+              #Name " header");                                     \
+        check(p.read(back, &backTail) && backTail == tail,          \
+              #Name " did not decode");                             \
+        Name##_FIELDS(PROTOCOL_FIELD_CHECK)                         \
+        corrupt(packet);                                            \
+    }
+
+#define PROTOCOL_COUNT(Name, id) + 1
+
+int main(int argc, char **argv) {
+    uint rounds = (argc > 1)? atoi(argv[1]) : 100000;
+    const uint messages = 0 PROTOCOL_MESSAGES(PROTOCOL_COUNT);
+
+    PROTOCOL_MESSAGES(PROTOCOL_ROUNDTRIP)
+
+    for(uint i = 0; i < rounds; i++) {
+        string junk(rng() % 64, '\0');
+        for(char &c : junk)
+            c = rng();
+        Packet p(junk);
+        BatPos b;
+        attempts++;
+        escaped += p.valid();
+        p.read(b);
+    }
+
+    check(escaped <= 4 + attempts / 16384, "too much damage went unnoticed");
+    cout << "round trips: " << messages * rounds << ", failures: " << failures
+         << ", damaged or junk packets accepted: " << escaped << "/"
+         << attempts << endl;
+
+    BatPos pos;
+    const uint n = 10000000;
+    uint64_t sum = 0;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    for(uint i = 0; i < n; i++) {
+        pos.x = i & 1023;
+        pos.y = i & 511;
+        sum += encode(pos, i).size();
+    }
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    string packet = encode(pos, 1);
+    for(uint i = 0; i < n; i++) {
+        Packet p(packet);
+        p.read(pos);
+        sum += pos.x;
+    }
+    chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
+
+    cout << "BatPos is " << packet.size() << " bytes (was 8)" << endl
+         << "encode: " << n / chrono::duration<double>(t1 - t0).count() / 1e6
+         << " M msg/s" << endl
+         << "decode: " << n / chrono::duration<double>(t2 - t1).count() / 1e6
+         << " M msg/s (" << sum % 10 << ")" << endl;
+
+    return failures? 1 : 0;
+}
+#endif
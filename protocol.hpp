@@ -0,0 +1,228 @@
+#pragma once
+#include <string>
+#include <cstdint>
+
+using namespace std;
+
+/* Wire protocol. Every message is described once, in the schema below,
+ * and the structs with their encoders and decoders are generated from
+ * it, so the two can't drift apart.
+ *
+ * PROTOCOL_MESSAGES lists messages as M(Name, type id). For each of
+ * them Name_FIELDS lists fields as F(type, name, min, max, step). A
+ * field is clamped to [min, max], rounded to a multiple of step and
+ * takes just as many bits as it needs for (max - min) / step.
+ *
+ * Packet on the wire, bit-packed, least significant bit first:
+ *   version  4 bits
+ *   type     6 bits
+ *   seq     16 bits   sender's packet counter
+ *   fields            as the schema says
+ *   (padding to whole byte)
+ *   tail              raw bytes, only some messages have it
+ *   crc16             CRC-16/CCITT of everything before it
+ *
+ * Anything that comes with other version or wrong checksum is dropped.
+ * Bump version whenever the schema changes. */
+
+#define PROTOCOL_MESSAGES(M) \
+    M(Hello,  1)             \
+    M(BatPos, 2)             \
+    M(Join,   3)             \
+    M(State,  4)             \
+    M(Control, 5)            \
+    M(Ack,    6)             \
+    M(Ping,   7)             \
+    M(Pong,   8)             \
+    M(Input,  9)             \
+    M(Seat,   10)            \
+    M(Frame,  11)            \
+    M(Move,   12)
+
+// Handshake, nonce is echoed back.
+#define Hello_FIELDS(F)                            \
+    F(uint32_t, nonce, 0, 0xffffffff, 1)
+
+// Position of sender's bat.
+#define BatPos_FIELDS(F)                           \
+    F(int32_t,  x,     -4096, 4095, 1)             \
+    F(int32_t,  y,     -4096, 4095, 1)
+
+// Spectator wants to watch (or still watches).
+#define Join_FIELDS(F)
+
+// Game state for spectators, Playground::state() goes in tail.
+#define State_FIELDS(F)                            \
+    F(uint32_t, tick,  0, 0xffffffff, 1)
+
+// Reliable control message, see ReliableChannel in net.hpp.
+#define Control_FIELDS(F)                          \
+    F(uint32_t, id,    0, 0xffff, 1)               \
+    F(uint32_t, kind,  0, 15, 1)                   \
+    F(int32_t,  arg,   -128, 127, 1)
+
+/* Round trip to relay server, sent is sender's clock when it went.
+ * It answers with Pong of the same sent. */
+#define Ping_FIELDS(F)                             \
+    F(uint32_t, sent,  0, 0xffffffff, 1)
+
+#define Pong_FIELDS(F)                             \
+    F(uint32_t, sent,  0, 0xffffffff, 1)
+
+/* Sender's bat x for ticks first, first + 1, ..., as int16 each in
+ * tail. Sender has all receiver's inputs for ticks before ack. */
+#define Input_FIELDS(F)                            \
+    F(uint32_t, first, 0, 0xffffffff, 1)           \
+    F(uint32_t, ack,   0, 0xffffffff, 1)
+
+// Relay server tells a client where it sits in a match of players.
+#define Seat_FIELDS(F)                             \
+    F(uint32_t, seat,    0, 7, 1)                  \
+    F(uint32_t, players, 1, 8, 1)
+
+/* Relay server's ticks first, first + 1, ..., each of them as int16 x
+ * of every seat's bat, in seat order, in tail. */
+#define Frame_FIELDS(F)                            \
+    F(uint32_t, first, 0, 0xffffffff, 1)
+
+/* Where the client wants its bat, and the first tick of the relay
+ * server it doesn't have yet. */
+#define Move_FIELDS(F)                             \
+    F(int32_t,  x,     -4096, 4095, 1)             \
+    F(uint32_t, ack,   0, 0xffffffff, 1)
+
+/* Control messages received: every id before base, and base + 1 + i
+ * for each bit i set in mask. */
+#define Ack_FIELDS(F)                              \
+    F(uint32_t, base,  0, 0xffff, 1)               \
+    F(uint32_t, mask,  0, 0xffffffff, 1)
+
+namespace msg {
+
+const uint version = 7;
+const uint maxPacket = 1400;
+
+// Bits needed to store numbers from 0 to n.
+constexpr uint bitsFor(uint64_t n) {
+    return n ? 1 + bitsFor(n >> 1) : 0;
+}
+
+class BitWriter {
+    public:
+    BitWriter(string &out): out(out) {}
+
+    void bits(uint64_t value, uint n);
+    void field(int64_t value, int64_t lo, int64_t hi, int64_t step);
+    void flush();
+
+    private:
+    string &out;
+    uint64_t acc = 0;
+    uint used = 0;
+};
+
+class BitReader {
+    public:
+    BitReader(const char *data, uint size): data(data), size(size) {}
+
+    uint64_t bits(uint n);
+    int64_t field(int64_t lo, int64_t hi, int64_t step);
+
+    // False once anything was read past the end.
+    bool ok() const { return !overrun; }
+    // Bytes taken so far, counting the last one started.
+    uint consumed() const { return (pos + 7) / 8; }
+
+    private:
+    const char *data;
+    uint size, pos = 0;
+    bool overrun = false;
+};
+
+#define PROTOCOL_FIELD_MEMBER(type, name, lo, hi, step) \
+    type name = lo;
+#define PROTOCOL_FIELD_PUT(type, name, lo, hi, step) \
+    out.field(name, lo, hi, step);
+#define PROTOCOL_FIELD_GET(type, name, lo, hi, step) \
+    name = (type) in.field(lo, hi, step);
+#define PROTOCOL_FIELD_BITS(type, name, lo, hi, step) \
+    + bitsFor(((int64_t) hi - (int64_t) lo) / step)
+
+#define PROTOCOL_STRUCT(Name, id)                                  \
+    struct Name {                                                  \
+        static const uint type = id;                               \
+        static const uint bits = 0 Name##_FIELDS(PROTOCOL_FIELD_BITS); \
+        Name##_FIELDS(PROTOCOL_FIELD_MEMBER)                       \
+        void put(BitWriter &out) const {                           \
+            Name##_FIELDS(PROTOCOL_FIELD_PUT)                      \
+        }                                                          \
+        void get(BitReader &in) {                                  \
+            Name##_FIELDS(PROTOCOL_FIELD_GET)                      \
+        }                                                          \
+    };
+
+PROTOCOL_MESSAGES(PROTOCOL_STRUCT)
+
+#undef PROTOCOL_STRUCT
+
+const char *name(uint type);
+
+uint16_t crc16(const char *data, uint size);
+
+const uint headerBits = 4 + 6 + 16;
+
+void putHeader(BitWriter &out, uint type, uint16_t seq);
+void seal(string &packet);
+
+template<class M>
+string encode(const M &m, uint16_t seq, const string &tail = "") {
+    string packet;
+    packet.reserve(8 + M::bits / 8 + tail.size());
+
+    BitWriter out(packet);
+    putHeader(out, M::type, seq);
+    m.put(out);
+    out.flush();
+
+    packet += tail;
+    seal(packet);
+
+    return packet;
+}
+
+/* Received packet. It's checked right away, read() only if valid(). */
+class Packet {
+    public:
+    Packet(): good(false) {}
+    Packet(const string &bytes);
+
+    bool valid() const { return good; }
+    uint type() const { return kind; }
+    uint16_t seq() const { return number; }
+
+    // Decodes the message if it is of that type.
+    template<class M>
+    bool read(M &m, string *tail = NULL) const {
+        if(!good || kind != M::type)
+            return false;
+
+        BitReader in(body.data(), body.size());
+        in.bits(headerBits);
+        m.get(in);
+        if(!in.ok())
+            return false;
+
+        if(tail)
+            tail->assign(body, in.consumed(), string::npos);
+
+        return true;
+    }
+
+    private:
+    bool good;
+    uint kind = 0;
+    uint16_t number = 0;
+    string body;    // all but the checksum
+};
+
+}
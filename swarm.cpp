@@ -0,0 +1,409 @@
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <sys/resource.h>
+
+#include "net.hpp"
+#include "geometry.hpp"
+
+using namespace std;
+
+/* Load generator for RelayServer. Runs a swarm of simulated clients on
+ * this machine, each with its own socket, speaking the real protocol:
+ * hello until answered, msg::Move rate times a second once seated,
+ * a ping every quarter of a second, frames read and acknowledged.
+ *
+ *   swarm [clients [seconds [behaviour [rate [players [threads [host]]]]]]]
+ *
+ * Without host, server runs here in a thread of its own, with matches
+ * for all the clients, and its side gets measured too: packets it
+ * handled, its CPU time and what it never got or what never came from
+ * it. With host, only what clients see is reported.
+ *
+ * Behaviours:
+ *  still   bat never moves.
+ *  sweep   bat moves with every packet, side to side.
+ *  lossy   sweep, but tenth of the packets are thrown away unsent.
+ *  burst   sweep, packets go six at once every 100 ms.
+ *
+ * Input latency is from sending a new x until a frame with it comes
+ * back, that's a tick of the server (up to tickInterval) plus two
+ * trips. Every x sent is remembered for a while, so a frame that
+ * comes late is still matched with the x it shows, however many were
+ * sent since. Ping is the round trip alone, including how long the
+ * packet waited in server's socket. Only what is sent after warmup
+ * counts, the match setup doesn't; its answers count whenever they
+ * come. */
+
+enum Behaviour {
+    still, sweep, lossy, burst
+};
+
+static double now() {
+    return chrono::duration<double>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double cpuSeconds(clockid_t clock) {
+    timespec t;
+    clock_gettime(clock, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+struct SwarmStats {
+    unsigned long long sent = 0, received = 0, thrownAway = 0,
+                       pings = 0, pongs = 0, ticks = 0;
+    uint playing = 0;
+    vector<float> inputLatency, pingRtt;    // ms
+
+    void add(const SwarmStats &o) {
+        sent += o.sent;
+        received += o.received;
+        thrownAway += o.thrownAway;
+        pings += o.pings;
+        pongs += o.pongs;
+        ticks += o.ticks;
+        playing += o.playing;
+        inputLatency.insert(inputLatency.end(), o.inputLatency.begin(),
+                            o.inputLatency.end());
+        pingRtt.insert(pingRtt.end(), o.pingRtt.begin(), o.pingRtt.end());
+    }
+};
+
+class SwarmClient {
+    public:
+    SwarmClient(const IPaddress &server, Behaviour how, double rate,
+                uint32_t nonce, double start)
+            : socket(0), server(server), how(how), period(1 / rate),
+              nonce(nonce), nextSend(start),
+              nextPing(start + (nonce % 1000) * 0.25 / 1000) {
+        x = nonce % 700;
+    }
+
+    /* Reads everything that came and sends whatever is due. Counts
+     * go to stats only once measuring. */
+    void run(double t, bool measuring, SwarmStats &stats) {
+        IPaddress from;
+        while(socket.receive(datagram, from)) {
+            msg::Packet p(datagram);
+            if(!p.valid())
+                continue;
+            if(measuring)
+                stats.received++;
+            handle(p, t, stats);
+        }
+
+        if(!answered) {
+            if(t >= nextHello) {
+                msg::Hello hello;
+                hello.nonce = nonce;
+                send(hello, measuring, stats);
+                nextHello = t + backoff;
+                backoff = min(backoff * 2, 0.8);
+            }
+            return;
+        }
+
+        if(t >= nextPing) {
+            msg::Ping ping;
+            ping.sent = (uint32_t)(uint64_t)(t * 1e6);
+            if(send(ping, measuring, stats) && measuring) {
+                stats.pings++;
+                pinged.push_back(ping.sent);
+                if(pinged.size() > remembered)
+                    pinged.pop_front();
+            }
+            nextPing += 0.25;
+        }
+
+        if(!seated)
+            return;
+
+        uint packets = 0;
+        if(how == burst) {
+            if(t >= nextSend) {
+                packets = 6;
+                nextSend += 6 * period;
+            }
+        } else
+            for(; t >= nextSend && packets < 4; packets++)
+                nextSend += period;
+        nextSend = max(nextSend, t - period);
+
+        for(uint i = 0; i < packets; i++) {
+            bool moved = how != still;
+            if(moved) {
+                if(x + step < 0 || x + step > 700)
+                    step = -step;
+                x += step;
+            }
+
+            msg::Move m;
+            m.x = x;
+            m.ack = have;
+            // thrown away ones never show, nothing to wait for
+            if(send(m, measuring, stats) && moved) {
+                moves.push_back(Sent {x, t, measuring});
+                if(moves.size() > remembered)
+                    moves.pop_front();
+            }
+        }
+    }
+
+    bool playing() const { return have > 0; }
+    Uint32 ticks() const { return have; }
+
+    private:
+    void handle(const msg::Packet &p, double t, SwarmStats &stats) {
+        msg::Hello hello;
+        msg::Seat seat;
+        msg::Frame frame;
+        msg::Pong pong;
+        string tail;
+
+        if(p.read(hello))
+            answered = answered || hello.nonce == nonce;
+        else if(p.read(seat)) {
+            seated = true;
+            mySeat = seat.seat;
+            players = seat.players;
+        } else if(p.read(frame, &tail) && players) {
+            uint n = tail.size() / (2 * players);
+            if(n == 0 || frame.first + n <= have)
+                return;
+
+            for(uint i = max(have.load(), frame.first) - frame.first; i < n; i++)
+                shows((int16_t) read16(&tail[2 * (i * players + mySeat)]),
+                      t, stats);
+            have = frame.first + n;
+        } else if(p.read(pong)) {
+            auto i = find(pinged.begin(), pinged.end(), pong.sent);
+            if(i == pinged.end())
+                return;
+            pinged.erase(i);
+            stats.pongs++;
+            stats.pingRtt.push_back(((uint32_t)(uint64_t)(t * 1e6) - pong.sent) / 1000.0);
+        }
+    }
+
+    /* A tick shows x. Server takes moves in order sent, so it is the
+     * oldest one with that x after the one shown before; those before
+     * it were passed over and never will show. */
+    void shows(Sint16 shown, double t, SwarmStats &stats) {
+        auto i = find_if(moves.begin(), moves.end(),
+                         [shown](const Sent &s) { return s.x == shown; });
+        if(i == moves.end())
+            return;
+
+        if(i->measured)
+            stats.inputLatency.push_back(1000 * (t - i->at));
+        moves.erase(moves.begin(), i + 1);
+    }
+
+    // False if it was thrown away.
+    template<class M>
+    bool send(const M &m, bool measuring, SwarmStats &stats) {
+        string packet = msg::encode(m, myPacketNo++);
+        if(how == lossy && rng() % 10 == 0) {
+            if(measuring)
+                stats.thrownAway++;
+            return false;
+        }
+
+        socket.send(packet, server);
+        socket.flush();
+        if(measuring)
+            stats.sent++;
+
+        return true;
+    }
+
+    struct Sent {
+        Sint16 x;
+        double at;
+        bool measured;
+    };
+
+    // moves and pings waiting for an answer, older ones are given up
+    static const uint remembered = 64;
+
+    UdpSocket socket;
+    IPaddress server;
+    Behaviour how;
+    double period;
+    uint32_t nonce;
+    minstd_rand rng;
+    string datagram;
+
+    bool answered = false, seated = false;
+    uint mySeat = 0, players = 0;
+    double nextHello = 0, backoff = 0.025, nextSend, nextPing;
+    Uint16 myPacketNo = 1;
+
+    Sint16 x, step = 7;
+    deque<Sent> moves;
+    deque<uint32_t> pinged;     // sent while measuring
+    atomic<Uint32> have{0};     // main thread samples it while it runs
+};
+
+static float percentile(vector<float> &v, double p) {
+    if(v.empty())
+        return 0;
+    size_t i = min(v.size() - 1, (size_t)(p * v.size()));
+    nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+int main(int argc, char **argv) {
+    uint clients = (argc > 1)? atoi(argv[1]) : 1000;
+    double seconds = (argc > 2)? atof(argv[2]) : 10;
+    string behaviour = (argc > 3)? argv[3] : "sweep";
+    double rate = (argc > 4)? atof(argv[4]) : 60;
+    uint players = (argc > 5)? atoi(argv[5]) : 4;
+    uint threads = (argc > 6)? max(atoi(argv[6]), 1) : 1;
+    const char *host = (argc > 7)? argv[7] : NULL;
+    const uint port = 4242;
+    const double warmup = 3;
+
+    const char *names[] = {"still", "sweep", "lossy", "burst"};
+    Behaviour how = sweep;
+    for(uint i = 0; i < 4; i++)
+        if(behaviour == names[i])
+            how = (Behaviour) i;
+
+    rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+
+    IPaddress server;
+    if(SDLNet_ResolveHost(&server, host? host : "127.0.0.1", port)) {
+        cerr << "can't resolve " << host << endl;
+        return 1;
+    }
+
+    // server here, if there is no other
+    RelayServer *relay = host? NULL
+        : new RelayServer(players, port, (clients + players - 1) / players);
+    atomic<bool> stop(false), measuring(false);
+    double serverCpu = 0;
+    RelayStats before, after;
+    thread serverThread;
+    if(relay)
+        serverThread = thread([&]() {
+            bool counting = false;
+            while(!stop) {
+                relay->poll();
+                if(measuring && !counting) {
+                    counting = true;
+                    before = relay->stats();
+                    serverCpu = -cpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+                }
+                SDL_Delay(1);
+            }
+            after = relay->stats();
+            serverCpu += cpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+        });
+
+    cout << "swarm: " << clients << " clients, " << rate << " packets/s, "
+         << names[how] << ", matches of " << players << ", "
+         << threads << " threads, server "
+         << (host? host : "here") << endl;
+
+    double start = now();
+    mt19937 seeds(1);
+    vector<SwarmClient*> swarm;
+    for(uint i = 0; i < clients; i++)
+        swarm.push_back(new SwarmClient(server, how, rate, seeds(),
+                                         start + (i % 1000) / (1000 * rate)));
+
+    vector<SwarmStats> stats(threads);
+    vector<thread> workers;
+    for(uint w = 0; w < threads; w++)
+        workers.push_back(thread([&, w]() {
+            while(!stop) {
+                double t = now();
+                for(uint i = w; i < swarm.size(); i += threads)
+                    swarm[i]->run(t, measuring, stats[w]);
+                this_thread::sleep_for(chrono::microseconds(500));
+            }
+        }));
+
+    while(now() - start < warmup)
+        SDL_Delay(10);
+    uint ready = 0;
+    for(SwarmClient *c : swarm)
+        ready += c->playing();
+    vector<Uint32> ticksBefore;
+    for(SwarmClient *c : swarm)
+        ticksBefore.push_back(c->ticks());
+
+    measuring = true;
+    double from = now();
+    while(now() - from < seconds)
+        SDL_Delay(10);
+    measuring = false;
+    double took = now() - from;
+
+    stop = true;
+    for(thread &t : workers)
+        t.join();
+    if(relay)
+        serverThread.join();
+
+    SwarmStats total;
+    for(SwarmStats &s : stats)
+        total.add(s);
+    for(uint i = 0; i < swarm.size(); i++) {
+        total.playing += swarm[i]->playing();
+        total.ticks += swarm[i]->ticks() - ticksBefore[i];
+    }
+
+    cout << "  " << ready << " playing after " << warmup << " s warmup, "
+         << total.playing << " at the end" << endl
+         << "  clients: " << total.sent / took << " packets/s sent, "
+         << total.received / took << " received, "
+         << total.ticks / took / max(total.playing, 1u) << " ticks/s each" << endl;
+
+    if(relay) {
+        double in = after.packetsIn - before.packetsIn,
+               out = after.packetsOut - before.packetsOut;
+        cout << "  server: " << in / took << " packets/s in, "
+             << out / took << " out, "
+             << (after.bytesOut - before.bytesOut) / took / 1e6 << " MB/s out, "
+             << 100 * serverCpu / took << "% of a core" << endl
+             // sent just before the end may still be on the way
+             << "  dropped: " << 100 * max(0.0, 1 - in / total.sent)
+             << "% on the way in, "
+             << 100 * max(0.0, 1 - total.received / out)
+             << "% on the way out" << endl;
+    }
+
+    cout << "  pings answered " << 100.0 * total.pongs / max(total.pings, 1ull)
+         << "%";
+    if(total.thrownAway)
+        cout << ", " << total.thrownAway << " packets thrown away on purpose";
+    cout << endl;
+
+    for(auto l : {make_pair("input latency", &total.inputLatency),
+                  make_pair("ping", &total.pingRtt)}) {
+        vector<float> &v = *l.second;
+        cout << "  " << l.first << " ms: p50 " << percentile(v, 0.5)
+             << ", p99 " << percentile(v, 0.99)
+             << ", p99.9 " << percentile(v, 0.999)
+             << ", max " << percentile(v, 1) << " (" << v.size() << " samples)"
+             << endl;
+    }
+
+    for(SwarmClient *c : swarm)
+        delete c;
+    delete relay;
+}